@@ -0,0 +1,194 @@
+/*
+ * Generate keysyms.h from X11/keysymdef.h: a minimal perfect hash from
+ * keysym names to values for parsing --key, and a table sorted by value for
+ * printing names in --monitor. Both avoid Xlib's keysym database, which is
+ * only consulted for names that are not listed in keysymdef.h.
+ *
+ * The hash is "hash and displace": names are distributed into buckets by
+ * keysym_hash(0, name), and each bucket gets a seed for which
+ * keysym_hash(seed, name) sends all of its names to free slots.
+ *
+ * Usage: mkkeysyms <path to keysymdef.h> > keysyms.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define fatal(...) do { \
+	fprintf(stderr, "mkkeysyms: " __VA_ARGS__); \
+	exit(1); \
+} while (0)
+
+/* Keep in sync with keysym_hash() in thotkeys.c */
+static uint32_t keysym_hash(uint32_t seed, const char *str)
+{
+	uint32_t h = 2166136261u ^ seed * 0x9e3779b9u;
+	for (; *str; str++)
+		h = (h ^ (unsigned char)*str) * 16777619u;
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	return h;
+}
+
+struct keysym {
+	char *name;
+	unsigned long value;
+	size_t order;
+	size_t offset;
+};
+
+struct bucket {
+	size_t index;
+	size_t *members;
+	size_t nummembers;
+};
+
+static struct keysym *keysyms;
+static size_t numkeysyms;
+
+static int compare_buckets(const void *a, const void *b)
+{
+	const struct bucket *x = a, *y = b;
+	if (x->nummembers != y->nummembers)
+		return x->nummembers < y->nummembers ? 1 : -1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static int compare_values(const void *a, const void *b)
+{
+	const struct keysym *x = *(struct keysym *const *)a, *y = *(struct keysym *const *)b;
+	if (x->value != y->value)
+		return x->value < y->value ? -1 : 1;
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static void parse(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		fatal("unable to open %s\n", path);
+
+	char line[1024], name[256];
+	unsigned long value;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "#define XK_%255s 0x%lx", name, &value) != 2)
+			continue;
+		keysyms = realloc(keysyms, sizeof(*keysyms) * (numkeysyms + 1));
+		if (!keysyms)
+			fatal("realloc failed\n");
+		keysyms[numkeysyms] = (struct keysym) {
+			.name = strdup(name),
+			.value = value,
+			.order = numkeysyms,
+		};
+		numkeysyms++;
+	}
+	fclose(fp);
+	if (!numkeysyms)
+		fatal("no keysyms found in %s\n", path);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 2)
+		fatal("usage: mkkeysyms <keysymdef.h>\n");
+	parse(argv[1]);
+
+	size_t numslots = numkeysyms;
+	size_t numbuckets = numkeysyms / 4 + 1;
+	struct bucket *buckets = calloc(numbuckets, sizeof(*buckets));
+	size_t *slots = malloc(sizeof(*slots) * numslots);
+	uint32_t *seeds = calloc(numbuckets, sizeof(*seeds));
+	bool *used = calloc(numslots, sizeof(*used));
+	if (!buckets || !slots || !seeds || !used)
+		fatal("calloc failed\n");
+
+	for (size_t i = 0; i < numbuckets; i++)
+		buckets[i].index = i;
+	for (size_t i = 0; i < numkeysyms; i++) {
+		struct bucket *b = &buckets[keysym_hash(0, keysyms[i].name) % numbuckets];
+		b->members = realloc(b->members, sizeof(*b->members) * (b->nummembers + 1));
+		if (!b->members)
+			fatal("realloc failed\n");
+		b->members[b->nummembers++] = i;
+	}
+	qsort(buckets, numbuckets, sizeof(*buckets), compare_buckets);
+
+	for (size_t i = 0; i < numbuckets && buckets[i].nummembers; i++) {
+		struct bucket *b = &buckets[i];
+		size_t tried[16];
+		uint32_t seed;
+		if (b->nummembers > 16)
+			fatal("too many collisions, adjust the bucket count\n");
+		for (seed = 1; seed < UINT16_MAX; seed++) {
+			size_t j;
+			for (j = 0; j < b->nummembers; j++) {
+				size_t slot = keysym_hash(seed, keysyms[b->members[j]].name) % numslots;
+				bool clash = used[slot];
+				for (size_t k = 0; k < j; k++)
+					clash |= tried[k] == slot;
+				if (clash)
+					break;
+				tried[j] = slot;
+			}
+			if (j == b->nummembers)
+				break;
+		}
+		if (seed == UINT16_MAX)
+			fatal("unable to find a perfect hash\n");
+		for (size_t j = 0; j < b->nummembers; j++) {
+			used[tried[j]] = true;
+			slots[tried[j]] = b->members[j];
+		}
+		seeds[b->index] = seed;
+	}
+
+	printf("/* Generated by mkkeysyms from keysymdef.h. Do not edit. */\n\n");
+	printf("#define NUM_KEYSYM_SLOTS %zu\n", numslots);
+	printf("#define NUM_KEYSYM_BUCKETS %zu\n\n", numbuckets);
+
+	size_t offset = 0;
+	printf("static const char keysym_names[] =");
+	for (size_t i = 0; i < numkeysyms; i++) {
+		keysyms[i].offset = offset;
+		offset += strlen(keysyms[i].name) + 1;
+		printf("\n\t\"%s\\0\"", keysyms[i].name);
+	}
+	printf(";\n\n");
+
+	printf("static const uint16_t keysym_seeds[NUM_KEYSYM_BUCKETS] = {");
+	for (size_t i = 0; i < numbuckets; i++)
+		printf("%s%u,", i % 12 ? " " : "\n\t", seeds[i]);
+	printf("\n};\n\n");
+
+	printf("static const struct { uint32_t name; uint32_t value; } "
+	       "keysym_slots[NUM_KEYSYM_SLOTS] = {");
+	for (size_t i = 0; i < numslots; i++) {
+		struct keysym *k = &keysyms[slots[i]];
+		printf("\n\t{ %zu, 0x%lx },", k->offset, k->value);
+	}
+	printf("\n};\n\n");
+
+	/* By value, keeping the first name defined for each value like Xlib */
+	struct keysym **byvalue = malloc(sizeof(*byvalue) * numkeysyms);
+	if (!byvalue)
+		fatal("malloc failed\n");
+	for (size_t i = 0; i < numkeysyms; i++)
+		byvalue[i] = &keysyms[i];
+	qsort(byvalue, numkeysyms, sizeof(*byvalue), compare_values);
+
+	size_t numvalues = 0;
+	for (size_t i = 0; i < numkeysyms; i++)
+		if (!i || byvalue[i]->value != byvalue[i - 1]->value)
+			byvalue[numvalues++] = byvalue[i];
+	printf("#define NUM_KEYSYM_VALUES %zu\n\n", numvalues);
+	printf("static const struct { uint32_t value; uint32_t name; } "
+	       "keysym_values[NUM_KEYSYM_VALUES] = {");
+	for (size_t i = 0; i < numvalues; i++)
+		printf("\n\t{ 0x%lx, %zu },", byvalue[i]->value, byvalue[i]->offset);
+	printf("\n};\n");
+	return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * Checks --defer in --shadow mode, without an X server: the decisions for a
+ * prefix chord (one key) and a longer chord (two keys) are read back from
+ * the shadow log.
+ */
+#define main thotkeys_main
+#include "thotkeys.c"
+#undef main
+
+static struct hotkey_config test_hotkeys[2];
+static FILE *shadow_out;
+
+static void press(size_t key, bool pressed)
+{
+	struct input_change change = {
+		.offset = offsetof(struct hotkey_map, keys) + key,
+		.pressed = pressed,
+	};
+	hotkey_input(&change, 0);
+}
+
+/* The shadow log since the previous call, as "<hotkey> <decision>" lines */
+static const char *decisions(void)
+{
+	static char out[1024];
+	char line[256];
+	size_t len = 0;
+	fflush(stdout);
+	rewind(shadow_out);
+	while (fgets(line, sizeof(line), shadow_out)) {
+		size_t idx;
+		char decision[32];
+		if (sscanf(line, "%zu %31s", &idx, decision) == 2)
+			len += (size_t)snprintf(out + len, sizeof(out) - len, "%zu %s\n",
+						idx, decision);
+	}
+	rewind(shadow_out);
+	if (ftruncate(fileno(shadow_out), 0))
+		fatal("ftruncate() failed: %s\n", strerror(errno));
+	out[len] = '\0';
+	return out;
+}
+
+static int failures;
+
+static void expect(const char *what, const char *want)
+{
+	const char *got = decisions();
+	if (strcmp(got, want)) {
+		fprintf(stderr, "FAIL %s:\nexpected:\n%sgot:\n%s", what, want, got);
+		failures++;
+	}
+}
+
+int main(void)
+{
+	shadow_out = tmpfile();
+	if (!shadow_out || dup2(fileno(shadow_out), STDOUT_FILENO) == -1)
+		fatal("unable to redirect stdout: %s\n", strerror(errno));
+
+	test_hotkeys[0].on_press = "prefix";
+	test_hotkeys[0].checkmap.keys[10] = 1;
+	test_hotkeys[1].on_press = "longer";
+	test_hotkeys[1].checkmap.keys[10] = 1;
+	test_hotkeys[1].checkmap.keys[11] = 1;
+	for (size_t i = 0; i < 2; i++)
+		test_hotkeys[i].pid = -1;
+
+	shadow = true;
+	defer_window = 60000;
+	running_hotkeys = test_hotkeys;
+	numrunning_hotkeys = 2;
+	matcher_init(&matcher, test_hotkeys, 2);
+	transitions = xcalloc(matcher.maxfanout + 1, sizeof(*transitions));
+	defer_init(test_hotkeys, 2);
+
+	press(10, true);
+	press(10, false);
+	expect("tap", "0 defer\n0 spawn\n0 terminate\n");
+
+	press(10, true);
+	press(11, true);
+	press(11, false);
+	press(10, false);
+	expect("longer chord", "0 defer\n1 spawn\n0 superseded\n1 terminate\n");
+
+	press(10, true);
+	press(30, true);
+	press(30, false);
+	press(10, false);
+	expect("other key", "0 defer\n0 spawn\n0 terminate\n");
+
+	return failures != 0;
+}
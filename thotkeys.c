@@ -1,17 +1,44 @@
 #include "config.h"
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <getopt.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <linux/input.h>
+#ifdef USE_IO_URING
+#include <liburing.h>
+#endif
 #include <X11/X.h>
 #include <X11/Xlib.h>
 #include <X11/XKBlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XInput.h>
 #include <X11/extensions/XInput2.h>
+#ifdef HAVE_XTEST
+#include <X11/extensions/XTest.h>
+#endif
+#include "keysyms.h"
+#ifdef STATIC_CONFIG
+#include "static-config.h"
+#endif
 
 static int VERBOSE = 0;
 
@@ -45,24 +72,593 @@ static inline void *xcalloc(size_t nmemb, size_t size)
 	return p;
 }
 
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+static long long now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long long now_ms(void)
+{
+	return now_us() / 1000;
+}
+
+/*
+ * One-shot timers on CLOCK_MONOTONIC, kept in a binary min-heap so that the
+ * event loop can find the next deadline in O(1).
+ */
+struct timer {
+	long long when;
+	size_t index;
+	bool armed;
+	void (*fire)(struct timer *, long long now);
+};
+
+static struct timer **timers;
+static size_t numtimers, captimers;
+
+static void timer_swap(size_t a, size_t b)
+{
+	struct timer *t = timers[a];
+	timers[a] = timers[b];
+	timers[b] = t;
+	timers[a]->index = a;
+	timers[b]->index = b;
+}
+
+static void timer_sift(size_t i)
+{
+	while (i > 0 && timers[(i - 1) / 2]->when > timers[i]->when) {
+		timer_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	while (1) {
+		size_t l = 2 * i + 1, r = l + 1, m = i;
+		if (l < numtimers && timers[l]->when < timers[m]->when)
+			m = l;
+		if (r < numtimers && timers[r]->when < timers[m]->when)
+			m = r;
+		if (m == i)
+			break;
+		timer_swap(i, m);
+		i = m;
+	}
+}
+
+static void timer_cancel(struct timer *t)
+{
+	if (!t->armed)
+		return;
+	size_t i = t->index;
+	t->armed = false;
+	if (i != --numtimers) {
+		timers[i] = timers[numtimers];
+		timers[i]->index = i;
+		timer_sift(i);
+	}
+}
+
+static void timer_arm(struct timer *t, long long when)
+{
+	timer_cancel(t);
+	if (numtimers == captimers) {
+		captimers = captimers ? captimers * 2 : 16;
+		timers = xrealloc(timers, sizeof(*timers) * captimers);
+	}
+	t->when = when;
+	t->index = numtimers;
+	t->armed = true;
+	timers[numtimers++] = t;
+	timer_sift(t->index);
+}
+
+/* Fire expired timers and return the poll() timeout until the next one. */
+static int run_timers(void)
+{
+	while (numtimers) {
+		long long now = now_ms();
+		struct timer *t = timers[0];
+		if (t->when > now)
+			return (int)(t->when - now > INT_MAX ? INT_MAX : t->when - now);
+		timer_cancel(t);
+		t->fire(t, now);
+	}
+	return -1;
+}
+
+/*
+ * The event loop. A watch is a file descriptor the loop waits on; when it is
+ * readable the callback is invoked. If buf is set, the loop also reads up to
+ * len bytes into it and passes the result (or -errno) as n, so that the
+ * io_uring backend can batch those reads into the same submission as the
+ * wait. Child processes are reaped by the loop and reported to
+ * child_handler. After loop_watch_remove(), release (if set) is called once
+ * the backend no longer refers to the watch, which may be later.
+ */
+struct watch {
+	int fd;
+	void *buf;
+	size_t len;
+	void (*ready)(struct watch *, ssize_t n);
+	void (*release)(struct watch *);
+	bool active;
+	unsigned inflight;
+};
+
+static void (*child_handler)(pid_t pid, int status);
+static sigset_t sigchld_mask;
+
+/* When the loop last woke up, as the arrival time of what it found then */
+static long long loop_woken;
+static sigset_t sigusr1_mask;
+
+static void loop_watch_add(struct watch *w);
+
+static void reap_children(void)
+{
+	pid_t pid;
+	int status;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		debug("reaped child process %d\n", pid);
+		if (child_handler)
+			child_handler(pid, status);
+	}
+}
+
+static void sigchld_ready(struct watch *w, ssize_t n)
+{
+	(void)n;
+	struct signalfd_siginfo info;
+	while (read(w->fd, &info, sizeof(info)) == sizeof(info))
+		;
+	reap_children();
+}
+
+static struct watch sigchld_watch = { .fd = -1, .ready = sigchld_ready };
+
+static void loop_signalfd_init(void)
+{
+	sigemptyset(&sigchld_mask);
+	sigaddset(&sigchld_mask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &sigchld_mask, NULL))
+		fatal("sigprocmask() failed: %s\n", strerror(errno));
+	sigchld_watch.fd = signalfd(-1, &sigchld_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sigchld_watch.fd == -1)
+		fatal("signalfd() failed: %s\n", strerror(errno));
+	loop_watch_add(&sigchld_watch);
+}
+
+#ifndef USE_IO_URING
+static struct watch **watches;
+static size_t numwatches;
+
+static void loop_init(void)
+{
+	loop_signalfd_init();
+}
+
+static void loop_watch_add(struct watch *w)
+{
+	watches = xrealloc(watches, sizeof(*watches) * (numwatches + 1));
+	watches[numwatches++] = w;
+	w->active = true;
+}
+
+static void loop_watch_remove(struct watch *w)
+{
+	for (size_t i = 0; i < numwatches; i++) {
+		if (watches[i] == w) {
+			watches[i] = watches[--numwatches];
+			break;
+		}
+	}
+	w->active = false;
+	if (w->release)
+		w->release(w);
+}
+
+static void loop_child_spawned(void)
+{
+}
+
+/* Wait up to timeout milliseconds (-1 for no limit) and dispatch watches. */
+static void loop_wait(int timeout)
+{
+	static struct pollfd *pfds;
+	static size_t cappfds;
+	if (cappfds < numwatches) {
+		cappfds = numwatches;
+		pfds = xrealloc(pfds, sizeof(*pfds) * cappfds);
+	}
+
+	size_t n = numwatches;
+	for (size_t i = 0; i < n; i++)
+		pfds[i] = (struct pollfd) { .fd = watches[i]->fd, .events = POLLIN };
+	if (poll(pfds, n, timeout) == -1) {
+		if (errno == EINTR)
+			return;
+		fatal("poll() failed: %s\n", strerror(errno));
+	}
+	loop_woken = now_us();
+
+	/* Callbacks may add or remove watches; look them up by fd again */
+	for (size_t i = 0; i < n; i++) {
+		if (!pfds[i].revents)
+			continue;
+		for (size_t j = 0; j < numwatches; j++) {
+			struct watch *w = watches[j];
+			if (w->fd != pfds[i].fd)
+				continue;
+			ssize_t ret = 0;
+			if (w->buf) {
+				ret = read(w->fd, w->buf, w->len);
+				if (ret == -1 && errno == EAGAIN)
+					break;
+				if (ret == -1)
+					ret = -errno;
+			}
+			w->ready(w, ret);
+			break;
+		}
+	}
+}
+#else
+/*
+ * io_uring backend. Every watch has a multishot poll armed in the ring; a
+ * readable watch with a buffer gets a read queued, which is submitted
+ * together with the next wait. Children are reaped by an IORING_OP_WAITID
+ * request where liburing and the kernel support it, and through the signalfd
+ * otherwise.
+ * All of this costs one io_uring_enter() per loop iteration.
+ */
+enum {
+	URING_POLL,
+	URING_READ,
+	URING_WAITID,
+};
+
+#define URING_TAG(ptr, op) ((__u64)(uintptr_t)(ptr) | (op))
+#define URING_PTR(data) ((struct watch *)(uintptr_t)((data) & ~(__u64)3))
+#define URING_OP(data) ((int)((data) & 3))
+
+static struct io_uring ring;
+#if HAVE_DECL_IO_URING_PREP_WAITID
+static siginfo_t waitid_info;
+static bool waitid_armed;
+static bool uring_waitid;
+#endif
+
+static struct io_uring_sqe *uring_sqe(void)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+	if (!sqe) {
+		io_uring_submit(&ring);
+		sqe = io_uring_get_sqe(&ring);
+		if (!sqe)
+			fatal("io_uring_get_sqe() failed\n");
+	}
+	return sqe;
+}
+
+static void uring_arm_poll(struct watch *w)
+{
+	w->inflight++;
+	struct io_uring_sqe *sqe = uring_sqe();
+	io_uring_prep_poll_multishot(sqe, w->fd, POLLIN);
+	io_uring_sqe_set_data64(sqe, URING_TAG(w, URING_POLL));
+}
+
+static void uring_arm_read(struct watch *w)
+{
+	w->inflight++;
+	struct io_uring_sqe *sqe = uring_sqe();
+	io_uring_prep_read(sqe, w->fd, w->buf, (unsigned)w->len, (__u64)-1);
+	io_uring_sqe_set_data64(sqe, URING_TAG(w, URING_READ));
+}
+
+static void loop_child_spawned(void)
+{
+#if HAVE_DECL_IO_URING_PREP_WAITID
+	if (!uring_waitid || waitid_armed)
+		return;
+	struct io_uring_sqe *sqe = uring_sqe();
+	io_uring_prep_waitid(sqe, P_ALL, 0, &waitid_info, WEXITED, 0);
+	io_uring_sqe_set_data64(sqe, URING_WAITID);
+	waitid_armed = true;
+#endif
+}
+
+static void loop_init(void)
+{
+	int ret = io_uring_queue_init(64, &ring, 0);
+	if (ret < 0)
+		fatal("io_uring_queue_init() failed: %s\n", strerror(-ret));
+#if HAVE_DECL_IO_URING_PREP_WAITID
+	/* liburing may know IORING_OP_WAITID while the kernel (before 6.7) does not */
+	struct io_uring_probe *probe = io_uring_get_probe_ring(&ring);
+	uring_waitid = probe && io_uring_opcode_supported(probe, IORING_OP_WAITID);
+	if (probe)
+		io_uring_free_probe(probe);
+	if (uring_waitid) {
+		/* Children are only reported by the ring; SIGCHLD need not wake us */
+		sigemptyset(&sigchld_mask);
+		return;
+	}
+#endif
+	loop_signalfd_init();
+}
+
+static void loop_watch_add(struct watch *w)
+{
+	w->active = true;
+	uring_arm_poll(w);
+}
+
+static void loop_watch_remove(struct watch *w)
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+	io_uring_prep_poll_remove(sqe, URING_TAG(w, URING_POLL));
+	io_uring_sqe_set_data64(sqe, 0);
+	w->active = false;
+}
+
+/* The last completion of a removed watch has arrived */
+static void uring_release(struct watch *w)
+{
+	if (!w->inflight && w->release)
+		w->release(w);
+}
+
+static void uring_complete(struct io_uring_cqe *cqe)
+{
+	__u64 data = io_uring_cqe_get_data64(cqe);
+	struct watch *w = URING_PTR(data);
+
+	switch (URING_OP(data)) {
+	case URING_POLL:
+		if (!w)
+			break;
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			w->inflight--;
+		if (!w->active) {
+			uring_release(w);
+			break;
+		}
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			uring_arm_poll(w);
+		if (cqe->res < 0)
+			break;
+		if (w->buf)
+			uring_arm_read(w);
+		else
+			w->ready(w, 0);
+		break;
+	case URING_READ:
+		w->inflight--;
+		if (!w->active)
+			uring_release(w);
+		else if (cqe->res != -EAGAIN)
+			w->ready(w, cqe->res);
+		break;
+#if HAVE_DECL_IO_URING_PREP_WAITID
+	case URING_WAITID:
+		waitid_armed = false;
+		if (cqe->res == -EINTR) {
+			loop_child_spawned();
+			break;
+		}
+		if (cqe->res == -ECHILD)
+			break;
+		if (cqe->res < 0) {
+			warn("IORING_OP_WAITID failed: %s; reaping through SIGCHLD instead\n",
+			     strerror(-cqe->res));
+			uring_waitid = false;
+			loop_signalfd_init();
+			reap_children();
+			break;
+		}
+		debug("reaped child process %d\n", waitid_info.si_pid);
+		if (child_handler)
+			child_handler(waitid_info.si_pid,
+				      waitid_info.si_code == CLD_EXITED ?
+				      W_EXITCODE(waitid_info.si_status, 0) :
+				      waitid_info.si_status);
+		loop_child_spawned();
+		break;
+#endif
+	}
+}
+
+/* Wait up to timeout milliseconds (-1 for no limit) and dispatch watches. */
+static void loop_wait(int timeout)
+{
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout / 1000,
+		.tv_nsec = (long long)(timeout % 1000) * 1000000,
+	};
+	struct io_uring_cqe *cqe;
+	int ret = io_uring_submit_and_wait_timeout(&ring, &cqe, 1,
+						   timeout < 0 ? NULL : &ts, NULL);
+	if (ret < 0 && ret != -ETIME && ret != -EINTR)
+		fatal("io_uring_submit_and_wait_timeout() failed: %s\n", strerror(-ret));
+	loop_woken = now_us();
+
+	struct io_uring_cqe *cqes[64];
+	unsigned n;
+	while ((n = io_uring_peek_batch_cqe(&ring, cqes, 64)) > 0) {
+		for (unsigned i = 0; i < n; i++)
+			uring_complete(cqes[i]);
+		io_uring_cq_advance(&ring, n);
+	}
+}
+#endif
+
+/* Touch chords: "N fingers down" on a touch device, for 1 <= N <= MAX_FINGERS */
+#define MAX_FINGERS 10
+
+/* Gamepad and joystick buttons read from evdev, BTN_MISC up to BTN_TRIGGER_HAPPY40 */
+#define PAD_BUTTON_BASE BTN_MISC
+#define PAD_BUTTONS 0x200
+
 struct hotkey_map {
 	char keys[256];
 	char buttons[256];
+	char fingers[MAX_FINGERS + 1];
+	char pad_buttons[PAD_BUTTONS];
+};
+
+struct adopted;
+
+/* A built-in window manager action, see wm_run() */
+enum wm_op {
+	WM_NONE,
+	WM_DESKTOP,
+	WM_SEND_TO_DESKTOP,
+	WM_CLOSE,
+	WM_FULLSCREEN,
+	WM_MAXIMIZE,
+	WM_ABOVE,
+	WM_MINIMIZE,
+	WM_MOVERESIZE,
 };
 
+#define WM_NEXT -1
+#define WM_PREV -2
+
+struct wm_action {
+	enum wm_op op;
+	long args[4];
+	unsigned moveresize_flags;
+};
+
+#define STATS_HOLD_BUCKETS 24
+#define STATS_HOURS 24
+
 struct hotkey_config {
 	const char **keystrs;
 	size_t numkeystrs;
 	const char **buttonstrs;
 	size_t numbuttonstrs;
+	long fingers;
+	const char **padstrs;
+	size_t numpadstrs;
+	const char **requirestrs;
+	size_t numrequirestrs;
+	const char **forbidstrs;
+	size_t numforbidstrs;
+	const char **whenstrs;
+	size_t numwhenstrs;
 	const char *on_press;
+	const char *on_unlatch;
+	const char *wmstr;
+	struct wm_action wm;
+	const char *led;
+	int bell;
+	bool latch;
+	long accumulate;
+	long cooldown;
+	long rate_count, rate_window;
+	bool coalesce;
 
-	struct hotkey_map keymap;
 	struct hotkey_map checkmap;
+	uint64_t require, forbid;
+	uint32_t state_mask, state_value;
 	bool activated;
+	bool latched;
 	pid_t pid;
+	struct adopted *adopted;
+	Atom led_atom;
+	bool led_on;
+
+	/*
+	 * --defer: the hotkeys whose chords are strict prefixes of this one, and
+	 * the inputs of those this one is a prefix of (NULL if there are none).
+	 * A prefix waits in "deferred" until the chord is resolved, and stays
+	 * "superseded" until release if it is resolved to a longer chord.
+	 */
+	uint32_t *prefixes;
+	size_t numprefixes;
+	struct hotkey_map *extensions;
+	bool deferred, superseded;
+	struct timer defer_timer;
+
+	/* Wheel buttons (4-7) counted rather than held, when accumulating */
+	unsigned wheelmask;
+	long ticks, delta;
+	long long last_flush;
+	struct timer flush_timer;
+
+	/*
+	 * Throttling state, on the server's event timestamps. The token bucket
+	 * is kept in units of 1/rate_window tokens, so that each millisecond
+	 * adds rate_count units and an activation costs rate_window units.
+	 */
+	bool throttled;
+	bool has_last;
+	Time last_activation;
+	Time bucket_stamp;
+	long long credit;
+	struct timer trailing_timer;
+
+	/*
+	 * Usage counters for the SIGUSR1 snapshot. Hold durations go into
+	 * power-of-two buckets of milliseconds; matches are also counted per
+	 * hour over the last STATS_HOURS hours, in a ring indexed by the hour.
+	 */
+	long long matched_at;
+	unsigned long matches, spawns, running_at_release;
+	unsigned long holds[STATS_HOLD_BUCKETS];
+	unsigned long hourly[STATS_HOURS];
+	long long hour;
 };
 
+/* Keep in sync with keysym_hash() in mkkeysyms.c */
+static uint32_t keysym_hash(uint32_t seed, const char *str)
+{
+	uint32_t h = 2166136261u ^ seed * 0x9e3779b9u;
+	for (; *str; str++)
+		h = (h ^ (unsigned char)*str) * 16777619u;
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	return h;
+}
+
+/*
+ * XStringToKeysym() and XKeysymToString(), answered from the perfect hash
+ * generated from keysymdef.h. Xlib is only asked about names not listed
+ * there, such as "U20AC" or "0x1008ff13": string_to_keysym() returns
+ * NoSymbol for those and leaves the fallback to the caller, so that it is
+ * safe to call from any thread.
+ */
+static KeySym string_to_keysym(const char *str)
+{
+	uint32_t seed = keysym_seeds[keysym_hash(0, str) % NUM_KEYSYM_BUCKETS];
+	uint32_t slot = keysym_hash(seed, str) % NUM_KEYSYM_SLOTS;
+	if (!strcmp(keysym_names + keysym_slots[slot].name, str))
+		return keysym_slots[slot].value;
+	return NoSymbol;
+}
+
+static const char *keysym_to_string(KeySym keysym)
+{
+	size_t lo = 0, hi = NUM_KEYSYM_VALUES;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (keysym_values[mid].value < keysym)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < NUM_KEYSYM_VALUES && keysym_values[lo].value == keysym)
+		return keysym_names + keysym_values[lo].name;
+	return XKeysymToString(keysym);
+}
+
 static Display *get_display(void)
 {
 	Display *display = XOpenDisplay(NULL);
@@ -71,7 +667,7 @@ static Display *get_display(void)
 	return display;
 }
 
-static XIDeviceInfo *get_device_info(Display *display, const char *name)
+static int get_device_id(Display *display, const char *name)
 {
 	bool use_id = true;
 	long id;
@@ -85,7 +681,7 @@ static XIDeviceInfo *get_device_info(Display *display, const char *name)
 	int num_devices;
 	XIDeviceInfo *devices = XIQueryDevice(display, XIAllDevices, &num_devices);
 
-	XIDeviceInfo *found = NULL;
+	int found = 0;
 	for (int i = 0; i < num_devices; i++) {
 		XIDeviceInfo *device = &devices[i];
 
@@ -95,39 +691,117 @@ static XIDeviceInfo *get_device_info(Display *display, const char *name)
 			if (found)
 				fatal("more than one keyboard found with the " \
 				      "name '%s'\n", name);
-			found = device;
+			found = device->deviceid;
 		}
 	}
+	XIFreeDeviceInfo(devices);
+	if (!found)
+		fatal("unable to find device '%s'\n", name);
 	return found;
 }
 
-static void prepare_monitor(Display *display, const char *device_name)
+/*
+ * Select raw events from all master devices. Raw touch events are only
+ * selected if requested, as selecting them makes the server track touches
+ * for us; only then is XInput 2.2 negotiated, which costs a round trip.
+ * Nothing else waits for the server here: the selection is only flushed,
+ * and the server queues events for us from the moment it processes it. --device is applied afterwards by filtering on the
+ * source device, see resolve_device(). Device hierarchy changes are only
+ * selected if button maps are tracked.
+ *
+ * Returns whether touch events were selected.
+ */
+static bool prepare_monitor(Display *display, bool touch, bool need_touch, bool buttons)
 {
-	XIDeviceInfo *info = NULL;
-	if (device_name) {
-		info = get_device_info(display, device_name);
-		if (!info)
-			fatal("unable to find device '%s'\n", device_name);
+	int major = 2, minor = 2;
+	if (touch && XIQueryVersion(display, &major, &minor) != Success)
+		fatal("XInput 2 is not available\n");
+	if (major == 2 && minor < 2) {
+		if (need_touch)
+			fatal("touch hotkeys require XInput 2.2, the server has %d.%d\n",
+			      major, minor);
+		touch = false;
 	}
 
 	XIEventMask mask;
-	mask.deviceid = info ? info->deviceid : XIAllMasterDevices;
+	mask.deviceid = XIAllMasterDevices;
 	mask.mask_len = XIMaskLen(XI_LASTEVENT);
 	mask.mask = xcalloc((size_t)mask.mask_len, 1);
 	XISetMask(mask.mask, XI_RawKeyPress);
 	XISetMask(mask.mask, XI_RawKeyRelease);
 	XISetMask(mask.mask, XI_RawButtonPress);
 	XISetMask(mask.mask, XI_RawButtonRelease);
+	if (touch) {
+		XISetMask(mask.mask, XI_RawTouchBegin);
+		XISetMask(mask.mask, XI_RawTouchEnd);
+	}
+
+	/* Devices coming and going, for their button maps */
+	XIEventMask hierarchy;
+	hierarchy.deviceid = XIAllDevices;
+	hierarchy.mask_len = XIMaskLen(XI_LASTEVENT);
+	hierarchy.mask = xcalloc((size_t)hierarchy.mask_len, 1);
+	XISetMask(hierarchy.mask, XI_HierarchyChanged);
+	XISetMask(hierarchy.mask, XI_DeviceChanged);
 
-	if (XISelectEvents(display,  DefaultRootWindow(display), &mask, 1))
+	XIEventMask masks[] = { mask, hierarchy };
+	if (XISelectEvents(display,  DefaultRootWindow(display), masks, buttons ? 2 : 1))
 		fatal("XISelectEvents() failed\n");
-	XSync(display, False);
+	XFlush(display);
 	free(mask.mask);
+	free(hierarchy.mask);
+	return touch;
+}
+
+/* If nonzero, events from other slave devices are ignored */
+static int source_device;
+
+static void resolve_device(Display *display, const char *device_name)
+{
+	if (device_name)
+		source_device = get_device_id(display, device_name);
+}
+
+/*
+ * --startup-report: time spent in each startup phase, measured from the
+ * start of main().
+ */
+static bool startup_report;
+static long long startup_begin, startup_last;
+
+static void startup_phase(const char *phase)
+{
+	if (!startup_report)
+		return;
+	long long now = now_us();
+	fprintf(stderr, "startup: %-8s %9.3f ms %9.3f ms total\n", phase,
+		(double)(now - startup_last) / 1000, (double)(now - startup_begin) / 1000);
+	startup_last = now;
+}
+
+static void display_ready(struct watch *w, ssize_t n)
+{
+	/* Nothing to do here; events are read by XPending() in next_event() */
+	(void)w;
+	(void)n;
 }
 
-static const XIRawEvent *process_event(Display *display, int *evtype)
+static struct watch display_watch = { .fd = -1, .ready = display_ready };
+
+/*
+ * Return the next raw input event that is already available, reading from
+ * the connection without blocking. Returns NULL if there is none; the caller
+ * then waits in loop_wait().
+ */
+static void button_maps_event(Display *display, XGenericEventCookie *cookie);
+static void wm_property_notify(const XPropertyEvent *ev);
+static void xkb_state_notify(const XkbEvent *ev);
+static int xkb_event_base = -1;
+
+static const XIRawEvent *next_event(Display *display, int *evtype)
 {
 	static XEvent ev;
+	static bool claimed;
 	XGenericEventCookie *cookie = &ev.xcookie;
 
 	static int xi_opcode;
@@ -136,11 +810,29 @@ static const XIRawEvent *process_event(Display *display, int *evtype)
 		if (!XQueryExtension(display, "XInputExtension", &xi_opcode, &event, &error))
 			fatal("X Input extension not available\n");
 	}
+	if (display_watch.fd == -1) {
+		display_watch.fd = ConnectionNumber(display);
+		loop_watch_add(&display_watch);
+	}
 
-	while (1) {
+	while (XPending(display)) {
+		if (claimed) {
+			XFreeEventData(display, cookie);
+			claimed = false;
+		}
 		XNextEvent(display, &ev);
-		if (!XGetEventData(display, cookie) ||
-		    cookie->type != GenericEvent ||
+		if (ev.type == PropertyNotify) {
+			wm_property_notify(&ev.xproperty);
+			continue;
+		}
+		if (ev.type == xkb_event_base) {
+			xkb_state_notify((XkbEvent *)&ev);
+			continue;
+		}
+		if (!XGetEventData(display, cookie))
+			continue;
+		claimed = true;
+		if (cookie->type != GenericEvent ||
 		    cookie->extension != xi_opcode)
 			continue;
 
@@ -149,218 +841,3431 @@ static const XIRawEvent *process_event(Display *display, int *evtype)
 		case XI_RawKeyRelease:
 		case XI_RawButtonPress:
 		case XI_RawButtonRelease:
+		case XI_RawTouchBegin:
+		case XI_RawTouchEnd:
+			if (source_device &&
+			    ((XIRawEvent *)cookie->data)->sourceid != source_device)
+				continue;
 			*evtype = cookie->evtype;
 			return cookie->data;
+		case XI_HierarchyChanged:
+		case XI_DeviceChanged:
+			button_maps_event(display, cookie);
+			break;
 		}
 	}
+	return NULL;
 }
 
-static void command_help(void)
+/*
+ * Touches currently down, per touch device. The input "N fingers" is pressed
+ * while any device has exactly N touches down, so a change in the count of a
+ * device releases one input and presses another.
+ */
+#define MAX_TOUCH_DEVICES 8
+
+struct touch_device {
+	int deviceid;
+	unsigned numtouches;
+	uint32_t touches[MAX_FINGERS];
+};
+
+static struct touch_device touch_devices[MAX_TOUCH_DEVICES];
+static unsigned devices_with_fingers[MAX_FINGERS + 1];
+
+struct input_change {
+	size_t offset;
+	bool pressed;
+};
+
+static struct touch_device *touch_device(int deviceid)
 {
-	fprintf(stderr, "%s\n", PACKAGE_STRING);
-	fprintf(stderr, "\n");
-	fprintf(stderr, "Commands:\n");
-	fprintf(stderr, "  thotkeys --help\n");
-	fprintf(stderr, "    Show this message.\n");
-	fprintf(stderr, "  thotkeys --monitor\n");
-	fprintf(stderr, "    Print key and button events to stdout.\n");
-	fprintf(stderr, "  thotkeys --hotkey [--key <keysym>] [--button <num>] --on-press <on-press>\n");
-	fprintf(stderr, "    Register a hotkey. See also 'Hotkey options' section.\n");
-	fprintf(stderr, "\n");
-	fprintf(stderr, "Options:\n");
-	fprintf(stderr, "  --device <device>\n");
-	fprintf(stderr, "    Monitor events from the specified device only.\n");
-	fprintf(stderr, "    <device> may be either the device name or the number. Check 'xinput list'.\n");
-	fprintf(stderr, "    [TODO: Support for mouse and multiple keyboard devices]\n");
-	fprintf(stderr, "  --verbose\n");
-	fprintf(stderr, "    Enable debugging output.\n");
-	fprintf(stderr, "\n");
-	fprintf(stderr, "Hotkey options:\n");
-	fprintf(stderr, "  --key <keysym>\n");
-	fprintf(stderr, "    Specify a key. Use --monitor to see the appropriate keysym string.\n");
-	fprintf(stderr, "  --button <num>\n");
-	fprintf(stderr, "    Specify a button by the button number.\n");
-	fprintf(stderr, "  --on-press <on-press>\n");
-	fprintf(stderr, "    Execute <on-press> on '/bin/sh -c' when all specified keys and buttons\n");
-	fprintf(stderr, "    are pressed at the same time.\n");
-	fprintf(stderr, "    SIGTERM will be sent to the process when the condition is no longer met.\n");
-	exit(0);
+	struct touch_device *idle = NULL;
+	for (size_t i = 0; i < MAX_TOUCH_DEVICES; i++) {
+		struct touch_device *d = &touch_devices[i];
+		if (d->deviceid == deviceid)
+			return d;
+		if (!idle && !d->numtouches)
+			idle = d;
+	}
+	if (idle) {
+		idle->deviceid = deviceid;
+		return idle;
+	}
+	return NULL;
 }
 
-static void command_monitor(const char *device_name)
+static size_t touch_update(int deviceid, uint32_t touchid, bool begin,
+			   struct input_change *out)
 {
-	Display *display = get_display();
-	prepare_monitor(display, device_name);
+	struct touch_device *d = touch_device(deviceid);
+	if (!d)
+		return 0;
 
-	struct hotkey_map keymap = { 0 };
-	while (1) {
-		int evtype;
-		const XIRawEvent *data = process_event(display, &evtype);
-		bool pressed;
-		char comment[256];
+	unsigned before = d->numtouches;
+	size_t i;
+	for (i = 0; i < d->numtouches; i++)
+		if (d->touches[i] == touchid)
+			break;
+	if (begin && i == d->numtouches && d->numtouches < MAX_FINGERS)
+		d->touches[d->numtouches++] = touchid;
+	else if (!begin && i < d->numtouches)
+		d->touches[i] = d->touches[--d->numtouches];
+	if (d->numtouches == before)
+		return 0;
 
-		switch (evtype) {
-		case XI_RawKeyPress:
-		case XI_RawKeyRelease:
-			if (data->detail > 255)
-				fatal("unexpected keycode %d\n", data->detail);
-			pressed = evtype == XI_RawKeyPress;
-			keymap.keys[data->detail] = pressed;
+	size_t num = 0;
+	if (before && !--devices_with_fingers[before])
+		out[num++] = (struct input_change) {
+			.offset = offsetof(struct hotkey_map, fingers) + before,
+			.pressed = false,
+		};
+	if (d->numtouches && !devices_with_fingers[d->numtouches]++)
+		out[num++] = (struct input_change) {
+			.offset = offsetof(struct hotkey_map, fingers) + d->numtouches,
+			.pressed = true,
+		};
+	return num;
+}
 
-			KeySym basekeysym = XkbKeycodeToKeysym(display, (KeyCode)data->detail, 0, 0);
-			snprintf(comment, sizeof(comment), "# %s key %s",
-				 pressed ? "pressed" : "released",
-				 XKeysymToString(basekeysym));
-			break;
-		case XI_RawButtonPress:
-		case XI_RawButtonRelease:
-			if (data->detail > 255)
-				fatal("unexpected button number %d\n", data->detail);
-			pressed = evtype == XI_RawButtonPress;
-			keymap.buttons[data->detail] = pressed;
+/*
+ * Button maps of the pointer devices. Raw events carry the physical button,
+ * before the device's button mapping ('xinput set-button-map', left-handed
+ * setups), while --button means the logical button. The map and button count
+ * of each device are loaded at startup and again when a device is added or
+ * changes. Devices without a known map use the identity.
+ */
+#define MAX_POINTER_DEVICES 32
 
-			snprintf(comment, sizeof(comment), "# %s button %d",
-				 pressed ? "pressed" : "released",
-				 data->detail);
-			break;
-		default:
-			fatal("unreachable\n");
-		}
+struct pointer_device {
+	int deviceid;
+	int numbuttons;
+	unsigned char map[256];
+};
 
-		for (int i = 0; i < 256; i++) {
-			if (keymap.keys[i]) {
-				KeySym keysym = XkbKeycodeToKeysym(display, (KeyCode)i, 0, 0);
-				printf("--key %s ", XKeysymToString(keysym));
-			}
-		}
-		for (int i = 0; i < 256; i++) {
-			if (keymap.buttons[i])
-				printf("--button %d ", i);
-		}
-		printf("%s\n", comment);
-	}
+static struct pointer_device pointer_devices[MAX_POINTER_DEVICES];
+static size_t numpointer_devices;
+
+/* Logical buttons referenced by a hotkey; others are dropped when set */
+static bool filter_buttons;
+static unsigned char buttons_used[256 / 8];
+
+static int x_error_code;
+
+static int trap_x_error(Display *display, XErrorEvent *error)
+{
+	(void)display;
+	x_error_code = error->error_code;
+	return 0;
 }
 
-static void command_hotkeys(const char *device_name, struct hotkey_config *hotkeys,
-			    size_t numhotkeys)
+static struct pointer_device *pointer_device(int deviceid)
 {
-	Display *display = get_display();
-	prepare_monitor(display, device_name);
+	for (size_t i = 0; i < numpointer_devices; i++)
+		if (pointer_devices[i].deviceid == deviceid)
+			return &pointer_devices[i];
+	return NULL;
+}
 
-	for (size_t i = 0; i < numhotkeys; i++) {
-		struct hotkey_config *c = hotkeys + i;
-		memset(&c->keymap, 0, sizeof(c->keymap));
-		memset(&c->checkmap, 0, sizeof(c->checkmap));
-		c->activated = false;
-		c->pid = -1;
+static void remove_pointer_device(int deviceid)
+{
+	struct pointer_device *d = pointer_device(deviceid);
+	if (d)
+		*d = pointer_devices[--numpointer_devices];
+}
 
-		for (size_t j = 0; j < c->numkeystrs; j++) {
-			const char *str = c->keystrs[j];
-			KeySym keysym = XStringToKeysym(str);
-			if (keysym == NoSymbol)
-				fatal("--key %s could not be recognized\n", str);
-			KeyCode keycode = XKeysymToKeycode(display, keysym);
-			if (keycode == 0)
-				fatal("--key %s could not be converted into keycode\n", str);
-			c->checkmap.keys[keycode] = 1;
-		}
-		for (size_t j = 0; j < c->numbuttonstrs; j++) {
-			const char *str = c->buttonstrs[j];
-			long num = strtol(str, NULL, 10);
-			if (num < 1 || num > 255)
-				fatal("--button %s could not be recognized\n", str);
-			c->checkmap.buttons[num] = 1;
-		}
+/* (Re)load the button maps of deviceid, or of all devices with XIAllDevices */
+static void load_button_maps(Display *display, int deviceid)
+{
+	/* The device may be gone already by the time a hotplug event is read */
+	int (*old_handler)(Display *, XErrorEvent *) = XSetErrorHandler(trap_x_error);
+	int num_devices = 0;
+	x_error_code = 0;
+	XIDeviceInfo *devices = XIQueryDevice(display, deviceid, &num_devices);
+	if (!devices || x_error_code) {
+		if (deviceid != XIAllDevices)
+			remove_pointer_device(deviceid);
+		XSetErrorHandler(old_handler);
+		if (devices)
+			XIFreeDeviceInfo(devices);
+		return;
 	}
 
-	while (1) {
-		// Reap child processes
-		pid_t pid;
-		int status;
-		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-			debug("reaped child process %d\n", pid);
-			for (size_t i = 0; i < numhotkeys; i++) {
-				struct hotkey_config *c = hotkeys + i;
-				if (c->pid == pid) {
-					c->pid = -1;
-					break;
-				}
-			}
+	for (int i = 0; i < num_devices; i++) {
+		XIDeviceInfo *info = &devices[i];
+		if (info->use != XISlavePointer && info->use != XIFloatingSlave)
+			continue;
+		int numbuttons = 0;
+		for (int j = 0; j < info->num_classes; j++)
+			if (info->classes[j]->type == XIButtonClass)
+				numbuttons = ((XIButtonClassInfo *)info->classes[j])->num_buttons;
+		remove_pointer_device(info->deviceid);
+		if (!numbuttons || numpointer_devices == MAX_POINTER_DEVICES)
+			continue;
+
+		struct pointer_device *d = &pointer_devices[numpointer_devices];
+		d->deviceid = info->deviceid;
+		d->numbuttons = numbuttons > 255 ? 255 : numbuttons;
+		for (int b = 0; b < 256; b++)
+			d->map[b] = (unsigned char)b;
+
+		unsigned char map[256];
+		int nmap = 0;
+		x_error_code = 0;
+		/* Both have replies, so their errors are already in */
+		XDevice *dev = XOpenDevice(display, (XID)info->deviceid);
+		if (dev) {
+			nmap = XGetDeviceButtonMapping(display, dev, map, sizeof(map));
+			XCloseDevice(display, dev);
+		}
+		if (x_error_code)
+			nmap = 0;
+		for (int b = 0; b < nmap && b < 255; b++)
+			d->map[b + 1] = map[b];
+		debug("device %d '%s': %d buttons, %s map\n", info->deviceid, info->name,
+		      d->numbuttons, nmap ? "custom" : "no");
+		numpointer_devices++;
+	}
+
+	/* Errors from XCloseDevice() must reach the trap */
+	XSync(display, False);
+	XSetErrorHandler(old_handler);
+	XIFreeDeviceInfo(devices);
+}
+
+static void button_maps_event(Display *display, XGenericEventCookie *cookie)
+{
+	if (cookie->evtype == XI_DeviceChanged) {
+		XIDeviceChangedEvent *ev = cookie->data;
+		if (ev->reason == XIDeviceChange)
+			load_button_maps(display, ev->sourceid);
+		return;
+	}
+
+	XIHierarchyEvent *ev = cookie->data;
+	for (int i = 0; i < ev->num_info; i++) {
+		XIHierarchyInfo *info = &ev->info[i];
+		if (info->flags & (XISlaveRemoved | XIDeviceDisabled))
+			remove_pointer_device(info->deviceid);
+		else if (info->flags & (XISlaveAdded | XIDeviceEnabled))
+			load_button_maps(display, info->deviceid);
+	}
+}
+
+static int logical_button(int deviceid, int button)
+{
+	struct pointer_device *d = pointer_device(deviceid);
+	return d ? d->map[button] : button;
+}
+
+/*
+ * Note the logical buttons used by the hotkeys, and warn about those that no
+ * device currently produces.
+ */
+static void check_button_bindings(const struct hotkey_config *hotkeys, size_t numhotkeys)
+{
+	for (size_t i = 0; i < numhotkeys; i++) {
+		for (int b = 1; b < 256; b++)
+			if (hotkeys[i].checkmap.buttons[b] || b < 32 && hotkeys[i].wheelmask & 1u << b)
+				buttons_used[b / 8] |= (unsigned char)(1 << b % 8);
+	}
+	filter_buttons = true;
+
+	for (int b = 1; b < 256; b++) {
+		if (!(buttons_used[b / 8] & 1 << b % 8))
+			continue;
+		bool found = !numpointer_devices;
+		for (size_t i = 0; i < numpointer_devices && !found; i++)
+			for (int p = 1; p <= pointer_devices[i].numbuttons && !found; p++)
+				found = pointer_devices[i].map[p] == b;
+		if (!found)
+			warn("--button %d: no pointer device has a button mapped to %d\n", b, b);
+	}
+}
+
+/* Map a raw event to the inputs it presses or releases, at most two. */
+static size_t event_inputs(int evtype, const XIRawEvent *data, struct input_change *out)
+{
+	switch (evtype) {
+	case XI_RawKeyPress:
+	case XI_RawKeyRelease:
+		if (data->detail > 255)
+			fatal("unexpected keycode %d\n", data->detail);
+		out[0].pressed = evtype == XI_RawKeyPress;
+		out[0].offset = offsetof(struct hotkey_map, keys) + (size_t)data->detail;
+		return 1;
+	case XI_RawButtonPress:
+	case XI_RawButtonRelease:
+	{
+		if (data->detail > 255)
+			fatal("unexpected button number %d\n", data->detail);
+		int button = logical_button(data->sourceid, data->detail);
+		if (!button || filter_buttons && !(buttons_used[button / 8] & 1 << button % 8))
+			return 0;
+		out[0].pressed = evtype == XI_RawButtonPress;
+		out[0].offset = offsetof(struct hotkey_map, buttons) + (size_t)button;
+		return 1;
+	}
+	case XI_RawTouchBegin:
+	case XI_RawTouchEnd:
+		return touch_update(data->sourceid, (uint32_t)data->detail,
+				    evtype == XI_RawTouchBegin, out);
+	}
+	return 0;
+}
+
+/* The kind of an input ("key", "button", "fingers" or "pad") and its number. */
+static const char *input_kind(size_t offset, int *detail)
+{
+	if (offset >= offsetof(struct hotkey_map, pad_buttons)) {
+		*detail = (int)(offset - offsetof(struct hotkey_map, pad_buttons)) + PAD_BUTTON_BASE;
+		return "pad";
+	}
+	if (offset >= offsetof(struct hotkey_map, fingers)) {
+		*detail = (int)(offset - offsetof(struct hotkey_map, fingers));
+		return "fingers";
+	}
+	if (offset >= offsetof(struct hotkey_map, buttons)) {
+		*detail = (int)(offset - offsetof(struct hotkey_map, buttons));
+		return "button";
+	}
+	*detail = (int)(offset - offsetof(struct hotkey_map, keys));
+	return "key";
+}
+
+/*
+ * Inputs that do not come from the X server are passed to input_handler
+ * directly, with the server time estimated from the latest X event.
+ */
+static void (*input_handler)(const struct input_change *change, Time time);
+
+static Time last_event_time;
+static long long last_event_mono;
+
+static Time current_server_time(void)
+{
+	return (Time)(uint32_t)(last_event_time + (Time)(now_ms() - last_event_mono));
+}
+
+#define PAD_BUTTON(name) { #name, name }
+
+static const struct {
+	const char *name;
+	int code;
+} pad_button_names[] = {
+	PAD_BUTTON(BTN_0), PAD_BUTTON(BTN_1), PAD_BUTTON(BTN_2), PAD_BUTTON(BTN_3),
+	PAD_BUTTON(BTN_4), PAD_BUTTON(BTN_5), PAD_BUTTON(BTN_6), PAD_BUTTON(BTN_7),
+	PAD_BUTTON(BTN_8), PAD_BUTTON(BTN_9),
+	PAD_BUTTON(BTN_TRIGGER), PAD_BUTTON(BTN_THUMB), PAD_BUTTON(BTN_THUMB2),
+	PAD_BUTTON(BTN_TOP), PAD_BUTTON(BTN_TOP2), PAD_BUTTON(BTN_PINKIE),
+	PAD_BUTTON(BTN_BASE), PAD_BUTTON(BTN_BASE2), PAD_BUTTON(BTN_BASE3),
+	PAD_BUTTON(BTN_BASE4), PAD_BUTTON(BTN_BASE5), PAD_BUTTON(BTN_BASE6),
+	PAD_BUTTON(BTN_DEAD),
+	PAD_BUTTON(BTN_SOUTH), PAD_BUTTON(BTN_EAST), PAD_BUTTON(BTN_C),
+	PAD_BUTTON(BTN_NORTH), PAD_BUTTON(BTN_WEST), PAD_BUTTON(BTN_Z),
+	PAD_BUTTON(BTN_A), PAD_BUTTON(BTN_B), PAD_BUTTON(BTN_X), PAD_BUTTON(BTN_Y),
+	PAD_BUTTON(BTN_TL), PAD_BUTTON(BTN_TR), PAD_BUTTON(BTN_TL2), PAD_BUTTON(BTN_TR2),
+	PAD_BUTTON(BTN_SELECT), PAD_BUTTON(BTN_START), PAD_BUTTON(BTN_MODE),
+	PAD_BUTTON(BTN_THUMBL), PAD_BUTTON(BTN_THUMBR),
+	PAD_BUTTON(BTN_DPAD_UP), PAD_BUTTON(BTN_DPAD_DOWN),
+	PAD_BUTTON(BTN_DPAD_LEFT), PAD_BUTTON(BTN_DPAD_RIGHT),
+};
+
+/*
+ * Parse a --pad-button: a name from <linux/input-event-codes.h> with or
+ * without the BTN_ prefix ("BTN_SOUTH", "south", "TRIGGER_HAPPY3"), or a code.
+ * Returns -1 if it is not a gamepad or joystick button.
+ */
+static int pad_button_code(const char *str)
+{
+	const char *name = strncasecmp(str, "BTN_", 4) ? str : str + 4;
+	for (size_t i = 0; i < sizeof(pad_button_names) / sizeof(pad_button_names[0]); i++)
+		if (!strcasecmp(pad_button_names[i].name + 4, name))
+			return pad_button_names[i].code;
+
+	char *endp;
+	long num;
+	if (!strncasecmp(name, "TRIGGER_HAPPY", 13)) {
+		num = strtol(name + 13, &endp, 10);
+		if (endp != name + 13 && !*endp && num >= 1 && num <= 40)
+			return BTN_TRIGGER_HAPPY1 + (int)num - 1;
+		return -1;
+	}
+	num = strtol(str, &endp, 0);
+	if (endp == str || *endp || num < PAD_BUTTON_BASE || num >= PAD_BUTTON_BASE + PAD_BUTTONS)
+		return -1;
+	return (int)num;
+}
+
+static const char *pad_button_name(int code, char *buf, size_t size)
+{
+	for (size_t i = 0; i < sizeof(pad_button_names) / sizeof(pad_button_names[0]); i++)
+		if (pad_button_names[i].code == code)
+			return pad_button_names[i].name;
+	if (code >= BTN_TRIGGER_HAPPY1 && code <= BTN_TRIGGER_HAPPY40)
+		snprintf(buf, size, "BTN_TRIGGER_HAPPY%d", code - BTN_TRIGGER_HAPPY1 + 1);
+	else
+		snprintf(buf, size, "0x%x", code);
+	return buf;
+}
+
+/*
+ * Gamepads and joysticks, read from their evdev nodes without blocking in
+ * the main loop. Each keeps the buttons it holds, to release them if the
+ * device goes away and to catch up after the kernel dropped events.
+ */
+struct pad {
+	struct watch watch;
+	char *path;
+	unsigned char pressed[PAD_BUTTONS / 8];
+	struct input_event events[64];
+};
+
+#define TEST_BIT(bits, n) ((bits)[(n) / 8] & 1 << (n) % 8)
+
+static void pad_set(struct pad *pad, int code, bool pressed)
+{
+	int n = code - PAD_BUTTON_BASE;
+	if (!TEST_BIT(pad->pressed, n) == !pressed)
+		return;
+	pad->pressed[n / 8] ^= (unsigned char)(1 << n % 8);
+
+	struct input_change change = {
+		.offset = offsetof(struct hotkey_map, pad_buttons) + (size_t)n,
+		.pressed = pressed,
+	};
+	if (input_handler)
+		input_handler(&change, current_server_time());
+}
+
+static void pad_close(struct pad *pad)
+{
+	debug("closing %s\n", pad->path);
+	for (int n = 0; n < PAD_BUTTONS; n++)
+		if (TEST_BIT(pad->pressed, n))
+			pad_set(pad, PAD_BUTTON_BASE + n, false);
+	loop_watch_remove(&pad->watch);
+	close(pad->watch.fd);
+	pad->watch.fd = -1;
+}
+
+static void pad_resync(struct pad *pad)
+{
+	unsigned char keys[KEY_MAX / 8 + 1] = { 0 };
+	if (ioctl(pad->watch.fd, EVIOCGKEY(sizeof(keys)), keys) == -1)
+		return;
+	for (int n = 0; n < PAD_BUTTONS; n++)
+		pad_set(pad, PAD_BUTTON_BASE + n, TEST_BIT(keys, PAD_BUTTON_BASE + n));
+}
+
+static void pad_ready(struct watch *w, ssize_t n)
+{
+	struct pad *pad = container_of(w, struct pad, watch);
+	if (n < 0) {
+		if (n != -EAGAIN)
+			pad_close(pad);
+		return;
+	}
+
+	size_t num = (size_t)n / sizeof(struct input_event);
+	for (size_t i = 0; i < num; i++) {
+		const struct input_event *ev = &pad->events[i];
+		if (ev->type == EV_SYN && ev->code == SYN_DROPPED)
+			pad_resync(pad);
+		else if (ev->type == EV_KEY && ev->value != 2 &&
+			 ev->code >= PAD_BUTTON_BASE && ev->code < PAD_BUTTON_BASE + PAD_BUTTONS)
+			pad_set(pad, ev->code, ev->value);
+	}
+}
+
+/*
+ * Open the given evdev nodes, or with none given, every node that reports
+ * gamepad or joystick buttons (BTN_GAMEPAD or BTN_JOYSTICK).
+ */
+static void open_pads(const char **paths, size_t numpaths)
+{
+	char buf[PATH_MAX];
+	DIR *dir = NULL;
+	bool denied = false;
+	size_t opened = 0;
+
+	if (!numpaths) {
+		dir = opendir("/dev/input");
+		if (!dir) {
+			warn("unable to open /dev/input: %s\n", strerror(errno));
+			return;
+		}
+	}
+
+	for (size_t i = 0; ; i++) {
+		const char *path;
+		if (dir) {
+			struct dirent *ent = readdir(dir);
+			if (!ent)
+				break;
+			if (strncmp(ent->d_name, "event", 5))
+				continue;
+			snprintf(buf, sizeof(buf), "/dev/input/%s", ent->d_name);
+			path = buf;
+		}
+		else {
+			if (i == numpaths)
+				break;
+			path = paths[i];
+		}
+
+		int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (fd == -1) {
+			if (!dir)
+				fatal("unable to open %s: %s\n", path, strerror(errno));
+			denied |= errno == EACCES;
+			continue;
+		}
+		unsigned char keys[KEY_MAX / 8 + 1] = { 0 };
+		if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) == -1 ||
+		    dir && !TEST_BIT(keys, BTN_GAMEPAD) && !TEST_BIT(keys, BTN_JOYSTICK)) {
+			close(fd);
+			continue;
+		}
+
+		char name[256] = "unknown";
+		ioctl(fd, EVIOCGNAME(sizeof(name)), name);
+		debug("reading gamepad buttons from %s (%s)\n", path, name);
+
+		struct pad *pad = xcalloc(1, sizeof(*pad));
+		pad->path = strdup(path);
+		pad->watch = (struct watch) {
+			.fd = fd,
+			.buf = pad->events,
+			.len = sizeof(pad->events),
+			.ready = pad_ready,
+		};
+		loop_watch_add(&pad->watch);
+		pad_resync(pad);
+		opened++;
+	}
+
+	if (dir) {
+		closedir(dir);
+		if (!opened)
+			warn("no gamepad or joystick found in /dev/input%s\n",
+			     denied ? " (permission denied; is the user in the 'input' group?)" : "");
+	}
+}
+
+/*
+ * Condition flags: named booleans mirroring the existence (or the contents) of
+ * files, such as a lock screen or game mode marker under /run/user. The
+ * parent directories are watched with inotify, so the flags are always
+ * current and checking them on activation costs no system call.
+ */
+#define MAX_CONDITIONS 64
+
+struct condition {
+	const char *name;
+	char *dir;
+	const char *base;
+	const char *value;
+	int wd;
+	/* While dir does not exist, the component of it to wait for */
+	char next[NAME_MAX + 1];
+};
+
+static struct condition conditions[MAX_CONDITIONS];
+static size_t numconditions;
+static uint64_t condition_flags;
+
+/* Parse --condition <name>:<path>[=<value>] */
+static void add_condition(const char *str)
+{
+	const char *colon = strchr(str, ':');
+	if (!colon || colon == str || !colon[1])
+		fatal("--condition %s must be <name>:<path>[=<value>]\n", str);
+	if (numconditions == MAX_CONDITIONS)
+		fatal("too many conditions (at most %d)\n", MAX_CONDITIONS);
+
+	char *name = strndup(str, (size_t)(colon - str));
+	for (size_t i = 0; i < numconditions; i++)
+		if (!strcmp(conditions[i].name, name))
+			fatal("--condition %s is defined twice\n", name);
+
+	char *path = strdup(colon + 1);
+	char *eq = strchr(path, '=');
+	if (eq)
+		*eq++ = '\0';
+	char *slash = strrchr(path, '/');
+	struct condition *cond = &conditions[numconditions++];
+	*cond = (struct condition) {
+		.name = name,
+		.value = eq,
+		.wd = -1,
+	};
+	if (!slash) {
+		cond->dir = strdup(".");
+		cond->base = path;
+	}
+	else {
+		cond->dir = strndup(path, slash == path ? 1 : (size_t)(slash - path));
+		cond->base = slash + 1;
+	}
+	if (!*cond->base)
+		fatal("--condition %s must name a file\n", str);
+}
+
+static int find_condition(const char *name)
+{
+	for (size_t i = 0; i < numconditions; i++)
+		if (!strcmp(conditions[i].name, name))
+			return (int)i;
+	return -1;
+}
+
+static void condition_update(size_t i)
+{
+	struct condition *cond = &conditions[i];
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", cond->dir, cond->base);
+
+	bool set;
+	if (!cond->value) {
+		set = access(path, F_OK) == 0;
+	}
+	else {
+		char buf[256];
+		ssize_t len = -1;
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd != -1) {
+			len = read(fd, buf, sizeof(buf) - 1);
+			close(fd);
+		}
+		while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == ' '))
+			len--;
+		if (len >= 0)
+			buf[len] = '\0';
+		set = len >= 0 && !strcmp(buf, cond->value);
+	}
+
+	uint64_t bit = (uint64_t)1 << i;
+	if (!(condition_flags & bit) == !set)
+		return;
+	debug("condition %s is now %s\n", cond->name, set ? "set" : "clear");
+	condition_flags ^= bit;
+}
+
+#define CONDITION_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+			  IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB)
+
+static struct watch inotify_watch;
+
+/*
+ * Watch the directory of a condition, or while it does not exist, its nearest
+ * existing parent, until the missing component appears. The same mask is
+ * used on every directory, as conditions may share them.
+ */
+static void condition_watch(size_t i)
+{
+	struct condition *cond = &conditions[i];
+	char path[PATH_MAX];
+	for (int tries = 0; tries < 16; tries++) {
+		snprintf(path, sizeof(path), "%s", cond->dir);
+		while ((cond->wd = inotify_add_watch(inotify_watch.fd, path, CONDITION_EVENTS)) == -1 &&
+		       (errno == ENOENT || errno == ENOTDIR) &&
+		       strcmp(path, ".") && strcmp(path, "/")) {
+			char *slash = strrchr(path, '/');
+			if (!slash)
+				strcpy(path, ".");
+			else
+				slash[slash == path] = '\0';
+		}
+		if (cond->wd == -1) {
+			warn("unable to watch %s for condition %s: %s\n",
+			     path, cond->name, strerror(errno));
+			cond->next[0] = '\0';
+			return;
+		}
+		if (!strcmp(path, cond->dir)) {
+			cond->next[0] = '\0';
+			return;
+		}
+
+		const char *rest = cond->dir;
+		if (strcmp(path, ".") || !strncmp(cond->dir, "./", 2))
+			rest += strlen(path);
+		rest += strspn(rest, "/");
+		size_t len = strcspn(rest, "/");
+		if (len > NAME_MAX)
+			len = NAME_MAX;
+		memcpy(cond->next, rest, len);
+		cond->next[len] = '\0';
+		debug("waiting for %s/%s to appear for condition %s\n", path, cond->next, cond->name);
+
+		/* It may have been created before the parent was watched */
+		char child[PATH_MAX];
+		snprintf(child, sizeof(child), "%s/%s", path, cond->next);
+		if (access(child, F_OK))
+			return;
+	}
+}
+
+static char inotify_buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+static void inotify_ready(struct watch *w, ssize_t n)
+{
+	(void)w;
+	if (n < 0)
+		return;
+	for (ssize_t off = 0; off < n; ) {
+		const struct inotify_event *ev = (const void *)(inotify_buf + off);
+		off += (ssize_t)(sizeof(*ev) + ev->len);
+
+		for (size_t i = 0; i < numconditions; i++) {
+			struct condition *cond = &conditions[i];
+			if (cond->wd != ev->wd)
+				continue;
+			if (ev->mask & IN_IGNORED ||
+			    cond->next[0] && ev->len && !strcmp(ev->name, cond->next)) {
+				condition_watch(i);
+				condition_update(i);
+			}
+			else if (!cond->next[0] && (ev->mask & IN_Q_OVERFLOW ||
+				 ev->len && !strcmp(ev->name, cond->base)))
+				condition_update(i);
+		}
+		if (ev->mask & IN_Q_OVERFLOW)
+			for (size_t i = 0; i < numconditions; i++)
+				condition_update(i);
+	}
+}
+
+static struct watch inotify_watch = {
+	.fd = -1,
+	.buf = inotify_buf,
+	.len = sizeof(inotify_buf),
+	.ready = inotify_ready,
+};
+
+static void conditions_init(void)
+{
+	if (!numconditions)
+		return;
+	inotify_watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_watch.fd == -1)
+		fatal("inotify_init1() failed: %s\n", strerror(errno));
+
+	for (size_t i = 0; i < numconditions; i++) {
+		condition_watch(i);
+		condition_update(i);
+	}
+	loop_watch_add(&inotify_watch);
+}
+
+/*
+ * The keyboard's modifier and group state, kept up to date from XkbStateNotify
+ * (see xkb_state_init()) for the --when predicates: effective modifiers in
+ * bits 0-7, latched modifiers in 8-15, locked modifiers in 16-23 and the
+ * effective group in 24-25.
+ */
+#define STATE_LATCHED_SHIFT 8
+#define STATE_LOCKED_SHIFT 16
+#define STATE_GROUP_SHIFT 24
+
+static uint32_t xkb_state;
+
+static bool hotkey_allowed(const struct hotkey_config *c)
+{
+	return (condition_flags & c->require) == c->require && !(condition_flags & c->forbid) &&
+	       (xkb_state & c->state_mask) == c->state_value;
+}
+
+static struct hotkey_config *running_hotkeys;
+static size_t numrunning_hotkeys;
+
+/*
+ * --shadow runs everything up to the point of acting: instead of running
+ * programs, signalling them and sending requests, each decision is printed
+ * to stdout as "<hotkey> <decision> <latency in us> <on-press>", where the
+ * latency is counted from the arrival of the input change that caused it
+ * ("-" for timers).
+ */
+static bool shadow;
+static long long input_begin;
+
+static void shadow_log(const struct hotkey_config *c, const char *decision)
+{
+	printf("%zu %s ", (size_t)(c - running_hotkeys), decision);
+	if (input_begin)
+		printf("%lld ", now_us() - input_begin);
+	else
+		printf("- ");
+	printf("%s\n", c->on_press);
+}
+
+/*
+ * Window manager actions (--wm), sent as EWMH client messages on the
+ * connection the hotkeys already use instead of through wmctrl or xdotool.
+ * The atoms are interned at startup; the active window and the desktops are
+ * kept up to date from PropertyNotify on the root window, so that an action
+ * is a single SendEvent request.
+ */
+enum {
+	NET_ACTIVE_WINDOW,
+	NET_CURRENT_DESKTOP,
+	NET_NUMBER_OF_DESKTOPS,
+	NET_CLOSE_WINDOW,
+	NET_WM_DESKTOP,
+	NET_WM_STATE,
+	NET_WM_STATE_FULLSCREEN,
+	NET_WM_STATE_MAXIMIZED_VERT,
+	NET_WM_STATE_MAXIMIZED_HORZ,
+	NET_WM_STATE_ABOVE,
+	NET_MOVERESIZE_WINDOW,
+	WM_CHANGE_STATE,
+	NUM_WM_ATOMS,
+};
+
+static char *wm_atom_names[NUM_WM_ATOMS] = {
+	"_NET_ACTIVE_WINDOW",
+	"_NET_CURRENT_DESKTOP",
+	"_NET_NUMBER_OF_DESKTOPS",
+	"_NET_CLOSE_WINDOW",
+	"_NET_WM_DESKTOP",
+	"_NET_WM_STATE",
+	"_NET_WM_STATE_FULLSCREEN",
+	"_NET_WM_STATE_MAXIMIZED_VERT",
+	"_NET_WM_STATE_MAXIMIZED_HORZ",
+	"_NET_WM_STATE_ABOVE",
+	"_NET_MOVERESIZE_WINDOW",
+	"WM_CHANGE_STATE",
+};
+
+static Display *wm_display;
+static Atom wm_atoms[NUM_WM_ATOMS];
+static Window wm_active_window;
+static long wm_current_desktop, wm_number_of_desktops;
+
+/* Source indication in EWMH requests: a pager or other direct user action */
+#define WM_SOURCE_USER 2
+
+static void parse_wm_action(const char *str, struct wm_action *a)
+{
+	static const struct {
+		const char *name;
+		enum wm_op op;
+		int numargs;
+	} actions[] = {
+		{ "desktop", WM_DESKTOP, 1 },
+		{ "send-to-desktop", WM_SEND_TO_DESKTOP, 1 },
+		{ "close", WM_CLOSE, 0 },
+		{ "fullscreen", WM_FULLSCREEN, 0 },
+		{ "maximize", WM_MAXIMIZE, 0 },
+		{ "above", WM_ABOVE, 0 },
+		{ "minimize", WM_MINIMIZE, 0 },
+		{ "move", WM_MOVERESIZE, 2 },
+		{ "resize", WM_MOVERESIZE, 2 },
+		{ "moveresize", WM_MOVERESIZE, 4 },
+	};
+
+	char *copy = strdup(str), *saveptr;
+	char *name = strtok_r(copy, " ", &saveptr);
+	size_t i;
+	for (i = 0; name && i < sizeof(actions) / sizeof(actions[0]); i++)
+		if (!strcmp(actions[i].name, name))
+			break;
+	if (!name || i == sizeof(actions) / sizeof(actions[0]))
+		fatal("--wm %s: unknown action\n", str);
+
+	*a = (struct wm_action) { .op = actions[i].op };
+	int n;
+	char *arg;
+	for (n = 0; (arg = strtok_r(NULL, " ", &saveptr)); n++) {
+		char *endp;
+		if (n == actions[i].numargs)
+			fatal("--wm %s: too many arguments\n", str);
+		if (actions[i].numargs == 1 && !strcmp(arg, "next"))
+			a->args[n] = WM_NEXT;
+		else if (actions[i].numargs == 1 && !strcmp(arg, "prev"))
+			a->args[n] = WM_PREV;
+		else {
+			a->args[n] = strtol(arg, &endp, 10);
+			if (endp == arg || *endp || actions[i].numargs == 1 && a->args[n] < 0)
+				fatal("--wm %s: invalid argument '%s'\n", str, arg);
+		}
+	}
+	if (n != actions[i].numargs)
+		fatal("--wm %s: expected %d arguments\n", str, actions[i].numargs);
+
+	/* _NET_MOVERESIZE_WINDOW flags: which of x, y, width and height are set */
+	if (!strcmp(name, "move")) {
+		a->moveresize_flags = 1 << 8 | 1 << 9;
+	}
+	else if (!strcmp(name, "resize")) {
+		a->args[2] = a->args[0];
+		a->args[3] = a->args[1];
+		a->moveresize_flags = 1 << 10 | 1 << 11;
+	}
+	else if (a->op == WM_MOVERESIZE) {
+		a->moveresize_flags = 1 << 8 | 1 << 9 | 1 << 10 | 1 << 11;
+	}
+	free(copy);
+}
+
+static long wm_get_cardinal(Atom property)
+{
+	Window root = DefaultRootWindow(wm_display);
+	Atom type;
+	int format;
+	unsigned long num, after;
+	unsigned char *data = NULL;
+	long value = -1;
+	if (XGetWindowProperty(wm_display, root, property, 0, 1, False, AnyPropertyType,
+			       &type, &format, &num, &after, &data) == Success &&
+	    data && format == 32 && num == 1)
+		value = *(long *)data;
+	if (data)
+		XFree(data);
+	return value;
+}
+
+static void wm_property_notify(const XPropertyEvent *ev)
+{
+	if (!wm_display || ev->window != DefaultRootWindow(wm_display))
+		return;
+	if (ev->atom == wm_atoms[NET_ACTIVE_WINDOW])
+		wm_active_window = (Window)wm_get_cardinal(ev->atom);
+	else if (ev->atom == wm_atoms[NET_CURRENT_DESKTOP])
+		wm_current_desktop = wm_get_cardinal(ev->atom);
+	else if (ev->atom == wm_atoms[NET_NUMBER_OF_DESKTOPS])
+		wm_number_of_desktops = wm_get_cardinal(ev->atom);
+}
+
+static void wm_init(Display *display)
+{
+	wm_display = display;
+	if (!XInternAtoms(display, wm_atom_names, NUM_WM_ATOMS, False, wm_atoms))
+		fatal("XInternAtoms() failed\n");
+	XSelectInput(display, DefaultRootWindow(display), PropertyChangeMask);
+	wm_active_window = (Window)wm_get_cardinal(wm_atoms[NET_ACTIVE_WINDOW]);
+	wm_current_desktop = wm_get_cardinal(wm_atoms[NET_CURRENT_DESKTOP]);
+	wm_number_of_desktops = wm_get_cardinal(wm_atoms[NET_NUMBER_OF_DESKTOPS]);
+}
+
+static void wm_send(Window window, int atom, long l0, long l1, long l2, long l3, long l4)
+{
+	XEvent ev = { 0 };
+	ev.xclient.type = ClientMessage;
+	ev.xclient.window = window;
+	ev.xclient.message_type = wm_atoms[atom];
+	ev.xclient.format = 32;
+	ev.xclient.data.l[0] = l0;
+	ev.xclient.data.l[1] = l1;
+	ev.xclient.data.l[2] = l2;
+	ev.xclient.data.l[3] = l3;
+	ev.xclient.data.l[4] = l4;
+	XSendEvent(wm_display, DefaultRootWindow(wm_display), False,
+		   SubstructureRedirectMask | SubstructureNotifyMask, &ev);
+	XFlush(wm_display);
+}
+
+/* Resolve "next" and "prev" against the current desktop, wrapping around */
+static long wm_desktop(long arg)
+{
+	long n = wm_number_of_desktops > 0 ? wm_number_of_desktops : 1;
+	long current = wm_current_desktop > 0 ? wm_current_desktop : 0;
+	if (arg == WM_NEXT)
+		return (current + 1) % n;
+	if (arg == WM_PREV)
+		return (current + n - 1) % n;
+	return arg;
+}
+
+static void wm_run(const struct wm_action *a)
+{
+	Window root = DefaultRootWindow(wm_display), active = wm_active_window;
+	long t = (long)current_server_time();
+	if (a->op != WM_DESKTOP && !active) {
+		debug("no active window\n");
+		return;
+	}
+
+	switch (a->op) {
+	case WM_DESKTOP:
+		wm_send(root, NET_CURRENT_DESKTOP, wm_desktop(a->args[0]), t, 0, 0, 0);
+		break;
+	case WM_SEND_TO_DESKTOP:
+		wm_send(active, NET_WM_DESKTOP, wm_desktop(a->args[0]), WM_SOURCE_USER, 0, 0, 0);
+		break;
+	case WM_CLOSE:
+		wm_send(active, NET_CLOSE_WINDOW, t, WM_SOURCE_USER, 0, 0, 0);
+		break;
+	case WM_FULLSCREEN:
+		wm_send(active, NET_WM_STATE, 2, (long)wm_atoms[NET_WM_STATE_FULLSCREEN],
+			0, WM_SOURCE_USER, 0);
+		break;
+	case WM_MAXIMIZE:
+		wm_send(active, NET_WM_STATE, 2, (long)wm_atoms[NET_WM_STATE_MAXIMIZED_VERT],
+			(long)wm_atoms[NET_WM_STATE_MAXIMIZED_HORZ], WM_SOURCE_USER, 0);
+		break;
+	case WM_ABOVE:
+		wm_send(active, NET_WM_STATE, 2, (long)wm_atoms[NET_WM_STATE_ABOVE],
+			0, WM_SOURCE_USER, 0);
+		break;
+	case WM_MINIMIZE:
+		wm_send(active, WM_CHANGE_STATE, IconicState, 0, 0, 0, 0);
+		break;
+	case WM_MOVERESIZE:
+		wm_send(active, NET_MOVERESIZE_WINDOW,
+			(long)a->moveresize_flags | WM_SOURCE_USER << 12,
+			a->args[0], a->args[1], a->args[2], a->args[3]);
+		break;
+	case WM_NONE:
+		break;
+	}
+}
+
+/*
+ * Feedback without a process: an XKB keyboard indicator (--led) that is lit
+ * while the hotkey is active, or latched, and the XKB bell (--bell) rung when
+ * it fires. Both are single requests on the hotkeys' connection.
+ */
+static Display *feedback_display;
+
+static void feedback_init(Display *display, struct hotkey_config *hotkeys, size_t numhotkeys)
+{
+	int opcode, event, error, major = XkbMajorVersion, minor = XkbMinorVersion;
+	if (!XkbQueryExtension(display, &opcode, &event, &error, &major, &minor))
+		fatal("--led and --bell require the XKB extension\n");
+	feedback_display = display;
+
+	char **names = xcalloc(numhotkeys + 1, sizeof(*names));
+	Atom *atoms = xcalloc(numhotkeys + 1, sizeof(*atoms));
+	int num = 0;
+	for (size_t i = 0; i < numhotkeys; i++)
+		if (hotkeys[i].led)
+			names[num++] = (char *)hotkeys[i].led;
+	if (num && !XInternAtoms(display, names, num, False, atoms))
+		fatal("XInternAtoms() failed\n");
+	num = 0;
+	for (size_t i = 0; i < numhotkeys; i++) {
+		if (!hotkeys[i].led)
+			continue;
+		hotkeys[i].led_atom = atoms[num++];
+		Bool state;
+		if (!XkbGetNamedIndicator(display, hotkeys[i].led_atom, NULL, &state, NULL, NULL))
+			warn("--led %s: the keyboard has no such indicator\n", hotkeys[i].led);
+	}
+	free(names);
+	free(atoms);
+}
+
+static void hotkey_feedback(struct hotkey_config *c, bool fired)
+{
+	if (shadow)
+		return;
+	if (fired && c->bell)
+		XkbBell(feedback_display, None, c->bell, None);
+
+	bool on = c->latch ? c->latched :
+		  c->activated && !c->throttled && !c->deferred && !c->superseded;
+	if (c->led && on != c->led_on) {
+		XkbSetNamedIndicator(feedback_display, c->led_atom, True, on, False, NULL);
+		c->led_on = on;
+	}
+	XFlush(feedback_display);
+}
+
+/*
+ * --when predicates on the keyboard state. Each is parsed into a mask and
+ * value on xkb_state. Modifiers other than the eight core names are looked
+ * up in the keyboard map, as their Mod<n> depends on it, and again whenever
+ * the map changes.
+ */
+static const struct {
+	const char *name;
+	unsigned mask;
+	KeySym keysym;
+	unsigned shift;
+} state_modifiers[] = {
+	{ "Shift",      ShiftMask,   NoSymbol,           0 },
+	{ "Lock",       LockMask,    NoSymbol,           0 },
+	{ "Control",    ControlMask, NoSymbol,           0 },
+	{ "Mod1",       Mod1Mask,    NoSymbol,           0 },
+	{ "Mod2",       Mod2Mask,    NoSymbol,           0 },
+	{ "Mod3",       Mod3Mask,    NoSymbol,           0 },
+	{ "Mod4",       Mod4Mask,    NoSymbol,           0 },
+	{ "Mod5",       Mod5Mask,    NoSymbol,           0 },
+	{ "Alt",        0,           XK_Alt_L,           0 },
+	{ "Super",      0,           XK_Super_L,         0 },
+	{ "AltGr",      0,           XK_ISO_Level3_Shift, 0 },
+	{ "NumLock",    0,           XK_Num_Lock,        0 },
+	{ "CapsLock",   LockMask,    NoSymbol,           STATE_LOCKED_SHIFT },
+};
+
+/* Never set in xkb_state; required by hotkeys whose predicates cannot hold */
+#define STATE_NEVER (1u << 31)
+
+/* Add a predicate to the hotkey's mask and value; returns an error or NULL */
+static const char *add_state_predicate(Display *display, struct hotkey_config *c,
+				       const char *str)
+{
+	const char *name = str, *eq = strchr(str, '=');
+	size_t len = eq ? (size_t)(eq - str) : strlen(str);
+	uint32_t bits, value;
+	if (len == 5 && !strncmp(str, "group", 5)) {
+		char *endp;
+		long group = eq ? strtol(eq + 1, &endp, 10) : 0;
+		if (!eq || endp == eq + 1 || *endp || group < 1 || group > 4)
+			return "the group must be 1 to 4";
+		bits = 3u << STATE_GROUP_SHIFT;
+		value = (uint32_t)(group - 1) << STATE_GROUP_SHIFT;
+	}
+	else {
+		int shift = -1;
+		if (len > 7 && !strncmp(str, "locked:", 7))
+			shift = STATE_LOCKED_SHIFT;
+		else if (len > 8 && !strncmp(str, "latched:", 8))
+			shift = STATE_LATCHED_SHIFT;
+		if (shift >= 0) {
+			const char *colon = strchr(str, ':') + 1;
+			len -= (size_t)(colon - str);
+			name = colon;
+		}
+
+		bool on;
+		if (!eq || !strcmp(eq + 1, "on"))
+			on = true;
+		else if (!strcmp(eq + 1, "off"))
+			on = false;
+		else
+			return "expected =on or =off";
+
+		size_t i;
+		for (i = 0; i < sizeof(state_modifiers) / sizeof(*state_modifiers); i++)
+			if (strlen(state_modifiers[i].name) == len &&
+			    !strncasecmp(state_modifiers[i].name, name, len))
+				break;
+		if (i == sizeof(state_modifiers) / sizeof(*state_modifiers))
+			return "unknown modifier";
+		if (state_modifiers[i].shift && shift >= 0)
+			return "CapsLock cannot take a prefix, use locked:Lock or latched:Lock";
+		unsigned mask = state_modifiers[i].mask;
+		if (state_modifiers[i].keysym != NoSymbol)
+			mask = XkbKeysymToModifiers(display, state_modifiers[i].keysym);
+		if (!mask)
+			return "no modifier is mapped to it";
+		if (shift < 0)
+			shift = (int)state_modifiers[i].shift;
+		bits = (uint32_t)(mask & 0xff) << shift;
+		value = on ? bits : 0;
+	}
+
+	if ((c->state_value ^ value) & c->state_mask & bits)
+		return "conflicts with another --when of the hotkey";
+	c->state_mask |= bits;
+	c->state_value |= value;
+	return NULL;
+}
+
+/* Turn the --when predicates into masks; at startup, errors are fatal */
+static void resolve_state_predicates(Display *display, struct hotkey_config *hotkeys,
+				     size_t numhotkeys, bool startup)
+{
+	for (size_t i = 0; i < numhotkeys; i++) {
+		struct hotkey_config *c = &hotkeys[i];
+		if (!c->numwhenstrs)
+			continue;
+		c->state_mask = c->state_value = 0;
+		for (size_t j = 0; j < c->numwhenstrs; j++) {
+			const char *err = add_state_predicate(display, c, c->whenstrs[j]);
+			if (!err)
+				continue;
+			if (startup)
+				fatal("--when %s: %s\n", c->whenstrs[j], err);
+			warn("--when %s: %s; the hotkey is disabled\n", c->whenstrs[j], err);
+			c->state_mask = c->state_value = STATE_NEVER;
+			break;
+		}
+	}
+}
+
+static void xkb_state_notify(const XkbEvent *ev)
+{
+	if (ev->any.xkb_type == XkbMapNotify || ev->any.xkb_type == XkbNewKeyboardNotify) {
+		debug("keyboard map changed, resolving --when again\n");
+		resolve_state_predicates(ev->any.display, running_hotkeys, numrunning_hotkeys, false);
+		return;
+	}
+	if (ev->any.xkb_type != XkbStateNotify)
+		return;
+	const XkbStateNotifyEvent *st = &ev->state;
+	xkb_state = (st->mods & 0xffu) |
+		    (st->latched_mods & 0xffu) << STATE_LATCHED_SHIFT |
+		    (st->locked_mods & 0xffu) << STATE_LOCKED_SHIFT |
+		    (uint32_t)(st->group & 3) << STATE_GROUP_SHIFT;
+	debug("keyboard state %08x\n", xkb_state);
+}
+
+static void xkb_state_init(Display *display, struct hotkey_config *hotkeys, size_t numhotkeys)
+{
+	int opcode, error, major = XkbMajorVersion, minor = XkbMinorVersion;
+	if (!XkbQueryExtension(display, &opcode, &xkb_event_base, &error, &major, &minor))
+		fatal("--when requires the XKB extension\n");
+
+	/* Selected before reading the map and state, so that no change falls between */
+	unsigned maps = XkbMapNotifyMask | XkbNewKeyboardNotifyMask;
+	if (!XkbSelectEvents(display, XkbUseCoreKbd, maps, maps))
+		fatal("XkbSelectEvents() failed\n");
+	unsigned long details = XkbModifierStateMask | XkbModifierLatchMask |
+				XkbModifierLockMask | XkbGroupStateMask;
+	if (!XkbSelectEventDetails(display, XkbUseCoreKbd, XkbStateNotify, details, details))
+		fatal("XkbSelectEventDetails() failed\n");
+	resolve_state_predicates(display, hotkeys, numhotkeys, true);
+
+	XkbStateRec st;
+	if (XkbGetState(display, XkbUseCoreKbd, &st) != Success)
+		fatal("XkbGetState() failed\n");
+	xkb_state = (st.mods & 0xffu) |
+		    (uint32_t)st.latched_mods << STATE_LATCHED_SHIFT |
+		    (uint32_t)st.locked_mods << STATE_LOCKED_SHIFT |
+		    (uint32_t)(st.group & 3) << STATE_GROUP_SHIFT;
+}
+
+static void command_help(void)
+{
+	fprintf(stderr, "%s\n", PACKAGE_STRING);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Commands:\n");
+	fprintf(stderr, "  thotkeys --help\n");
+	fprintf(stderr, "    Show this message.\n");
+	fprintf(stderr, "  thotkeys --monitor [--touch] [--pad-device <path>]\n");
+	fprintf(stderr, "    Print key and button events to stdout, touch events with --touch, and\n");
+	fprintf(stderr, "    gamepad buttons of the given devices.\n");
+	fprintf(stderr, "  thotkeys --monitor --trace\n");
+	fprintf(stderr, "    Print events in the trace format read by --replay.\n");
+	fprintf(stderr, "  thotkeys --hotkey [--key <keysym>] [--button <num>] [--fingers <num>] [--pad-button <name>] --on-press <on-press>\n");
+	fprintf(stderr, "    Register a hotkey. See also 'Hotkey options' section.\n");
+	fprintf(stderr, "  thotkeys --verify-matcher [--replay <trace>] [--seed <n>] [--rounds <n>] [--hotkey ...]\n");
+	fprintf(stderr, "    Check that the hotkey matcher makes the same decisions as the reference\n");
+	fprintf(stderr, "    implementation. Without --replay, <n> random traces are generated from\n");
+	fprintf(stderr, "    <seed>; without --hotkey, random hotkeys are generated for each.\n");
+	fprintf(stderr, "  thotkeys --stress <pattern> [--seed <n>] (--trace | --inject | --hotkey ...)\n");
+	fprintf(stderr, "    Generate adversarial input: 'mash', 'stuck' or 'wheel', with parameters\n");
+	fprintf(stderr, "    as in 'mash:keys=20,events=100000,rate=1000' (also base and button), or\n");
+	fprintf(stderr, "    a trace file. Print it as a trace, send it to the X server through XTest,\n");
+	fprintf(stderr, "    or run it through the hotkeys and report CPU time, spawns, peak live\n");
+	fprintf(stderr, "    children and the latency of each decision.\n");
+	fprintf(stderr, "  thotkeys --compile-config <file>\n");
+	fprintf(stderr, "    Print the options in <file> as C tables, for --with-static-config. A\n");
+	fprintf(stderr, "    binary built that way uses them when started without arguments.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  --device <device>\n");
+	fprintf(stderr, "    Monitor events from the specified device only.\n");
+	fprintf(stderr, "    <device> may be either the device name or the number. Check 'xinput list'.\n");
+	fprintf(stderr, "    [TODO: Support for mouse and multiple keyboard devices]\n");
+	fprintf(stderr, "  --pad-device <path>\n");
+	fprintf(stderr, "    Read --pad-button presses from the evdev node <path>, e.g.\n");
+	fprintf(stderr, "    /dev/input/by-id/...-event-joystick. May be given more than once. By default\n");
+	fprintf(stderr, "    every gamepad and joystick in /dev/input is used.\n");
+	fprintf(stderr, "  --condition <name>:<path>[=<value>]\n");
+	fprintf(stderr, "    Define a condition flag for --require and --forbid, set while <path>\n");
+	fprintf(stderr, "    exists, or with <value>, while the file contains <value>. The file is\n");
+	fprintf(stderr, "    watched with inotify. May be given up to 64 times.\n");
+	fprintf(stderr, "  --defer <ms>\n");
+	fprintf(stderr, "    Hold back a hotkey whose keys and buttons are a subset of another one's\n");
+	fprintf(stderr, "    for up to <ms> milliseconds, and skip it if the longer hotkey matches.\n");
+	fprintf(stderr, "    It is run once the time is up, on release, or when an input that is not\n");
+	fprintf(stderr, "    part of a longer hotkey is pressed.\n");
+	fprintf(stderr, "  --shadow\n");
+	fprintf(stderr, "    Run the hotkeys without acting on them: print each decision (spawn,\n");
+	fprintf(stderr, "    terminate, latch, throttled, ...) with its latency to stdout instead.\n");
+	fprintf(stderr, "  --state-file <path>\n");
+	fprintf(stderr, "    Record the processes of held hotkeys in <path>, so that a restarted\n");
+	fprintf(stderr, "    thotkeys adopts them and still terminates them on release.\n");
+	fprintf(stderr, "  --stats-file <path>\n");
+	fprintf(stderr, "    On SIGUSR1, write a JSON snapshot of the hotkeys' state to <path>\n");
+	fprintf(stderr, "    instead of stderr.\n");
+	fprintf(stderr, "  --startup-report\n");
+	fprintf(stderr, "    Print the time spent in each startup phase to stderr.\n");
+	fprintf(stderr, "  --verbose\n");
+	fprintf(stderr, "    Enable debugging output.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Hotkey options:\n");
+	fprintf(stderr, "  --key <keysym>\n");
+	fprintf(stderr, "    Specify a key. Use --monitor to see the appropriate keysym string.\n");
+	fprintf(stderr, "  --button <num>\n");
+	fprintf(stderr, "    Specify a button by the button number, after the device's button map\n");
+	fprintf(stderr, "    (see 'xinput get-button-map'). Use --monitor to see the number.\n");
+	fprintf(stderr, "  --fingers <num>\n");
+	fprintf(stderr, "    Require exactly <num> touches on a touchscreen or touchpad (XInput 2.2).\n");
+	fprintf(stderr, "  --pad-button <name>\n");
+	fprintf(stderr, "    Specify a gamepad or joystick button by its evdev name (BTN_SOUTH, TL,\n");
+	fprintf(stderr, "    TRIGGER_HAPPY1, ...) or code. Requires read access to /dev/input/event*.\n");
+	fprintf(stderr, "  --on-press <on-press>\n");
+	fprintf(stderr, "    Execute <on-press> on '/bin/sh -c' when all specified keys and buttons\n");
+	fprintf(stderr, "    are pressed at the same time.\n");
+	fprintf(stderr, "    SIGTERM will be sent to the process when the condition is no longer met.\n");
+	fprintf(stderr, "  --require <name>\n");
+	fprintf(stderr, "    Only activate the hotkey while the --condition <name> is set.\n");
+	fprintf(stderr, "  --forbid <name>\n");
+	fprintf(stderr, "    Only activate the hotkey while the --condition <name> is not set.\n");
+	fprintf(stderr, "  --when [locked:|latched:]<modifier>[=on|off], --when group=<n>\n");
+	fprintf(stderr, "    Only activate the hotkey while <modifier> (Shift, Lock, Control, Mod1-5,\n");
+	fprintf(stderr, "    Alt, Super, AltGr or NumLock) is active, locked or latched, or not\n");
+	fprintf(stderr, "    with =off, or while the keyboard is in layout group <n> (1-4).\n");
+	fprintf(stderr, "    CapsLock is short for locked:Lock.\n");
+	fprintf(stderr, "  --wm <action>\n");
+	fprintf(stderr, "    Instead of --on-press, send a request to the window manager: 'desktop\n");
+	fprintf(stderr, "    <n>|next|prev', 'send-to-desktop <n>|next|prev', 'close', 'fullscreen',\n");
+	fprintf(stderr, "    'maximize', 'above', 'minimize', 'move <x> <y>', 'resize <w> <h>' or\n");
+	fprintf(stderr, "    'moveresize <x> <y> <w> <h>'. Window actions apply to the active window.\n");
+	fprintf(stderr, "  --led <name>\n");
+	fprintf(stderr, "    Light the keyboard indicator <name> (e.g. 'Scroll Lock') while the\n");
+	fprintf(stderr, "    hotkey is active, or while it is latched with --latch.\n");
+	fprintf(stderr, "  --bell <percent>\n");
+	fprintf(stderr, "    Ring the keyboard bell at <percent> of the base volume (-100 to 100)\n");
+	fprintf(stderr, "    each time the hotkey fires.\n");
+	fprintf(stderr, "  --latch\n");
+	fprintf(stderr, "    Toggle on each press instead of following the keys: the first press\n");
+	fprintf(stderr, "    runs <on-press> with $THOTKEYS_LATCHED=1, the next one runs it (or\n");
+	fprintf(stderr, "    --on-unlatch) with $THOTKEYS_LATCHED=0. Processes are not terminated.\n");
+	fprintf(stderr, "  --on-unlatch <on-unlatch>\n");
+	fprintf(stderr, "    Execute <on-unlatch> when a --latch hotkey is toggled off. Implies --latch.\n");
+	fprintf(stderr, "  --accumulate <ms>\n");
+	fprintf(stderr, "    Treat wheel buttons (4-7) of the hotkey as ticks rather than held buttons.\n");
+	fprintf(stderr, "    Ticks received while the other keys and buttons are held are counted and\n");
+	fprintf(stderr, "    <on-press> is executed at most once per <ms> milliseconds, with the count\n");
+	fprintf(stderr, "    in $THOTKEYS_TICKS and the sum of +1 (buttons 4, 6) and -1 (buttons 5, 7)\n");
+	fprintf(stderr, "    in $THOTKEYS_DELTA. The process is not terminated on release.\n");
+	fprintf(stderr, "  --cooldown <ms>\n");
+	fprintf(stderr, "    Ignore activations within <ms> milliseconds of the previous one.\n");
+	fprintf(stderr, "  --rate-limit <count>/<ms>\n");
+	fprintf(stderr, "    Allow bursts of up to <count> activations, refilled at <count> per <ms>\n");
+	fprintf(stderr, "    milliseconds. Activations over the limit are ignored.\n");
+	fprintf(stderr, "  --coalesce\n");
+	fprintf(stderr, "    Instead of ignoring activations over --cooldown or --rate-limit, run\n");
+	fprintf(stderr, "    <on-press> once when the limit next allows it.\n");
+	exit(0);
+}
+
+static Display *monitor_display;
+static struct hotkey_map monitor_keymap;
+static bool monitor_trace;
+
+static void monitor_input(const struct input_change *change, Time time)
+{
+	Display *display = monitor_display;
+	bool pressed = change->pressed;
+	int detail;
+	const char *kind = input_kind(change->offset, &detail);
+	*((char *)&monitor_keymap + change->offset) = pressed;
+
+	if (monitor_trace) {
+		printf("%lu %s %s %d\n", time, kind, pressed ? "press" : "release", detail);
+		return;
+	}
+
+	char comment[256], buf[32];
+	if (!strcmp(kind, "key")) {
+		KeySym basekeysym = XkbKeycodeToKeysym(display, (KeyCode)detail, 0, 0);
+		snprintf(comment, sizeof(comment), "# %s key %s",
+			 pressed ? "pressed" : "released",
+			 keysym_to_string(basekeysym));
+	}
+	else if (!strcmp(kind, "pad")) {
+		snprintf(comment, sizeof(comment), "# %s pad button %s",
+			 pressed ? "pressed" : "released",
+			 pad_button_name(detail, buf, sizeof(buf)));
+	}
+	else {
+		snprintf(comment, sizeof(comment), "# %s %s %d",
+			 pressed ? "pressed" : "released", kind, detail);
+	}
+
+	for (int j = 0; j < 256; j++) {
+		if (monitor_keymap.keys[j]) {
+			KeySym keysym = XkbKeycodeToKeysym(display, (KeyCode)j, 0, 0);
+			printf("--key %s ", keysym_to_string(keysym));
+		}
+	}
+	for (int j = 0; j < 256; j++) {
+		if (monitor_keymap.buttons[j])
+			printf("--button %d ", j);
+	}
+	for (int j = 1; j <= MAX_FINGERS; j++) {
+		if (monitor_keymap.fingers[j])
+			printf("--fingers %d ", j);
+	}
+	for (int j = 0; j < PAD_BUTTONS; j++) {
+		if (monitor_keymap.pad_buttons[j])
+			printf("--pad-button %s ",
+			       pad_button_name(PAD_BUTTON_BASE + j, buf, sizeof(buf)));
+	}
+	printf("%s\n", comment);
+}
+
+static void command_monitor(const char *device_name, const char **pad_paths,
+			    size_t numpad_paths, bool trace, bool touch)
+{
+	Display *display = get_display();
+	prepare_monitor(display, touch, false, true);
+	resolve_device(display, device_name);
+	load_button_maps(display, XIAllDevices);
+
+	loop_init();
+	monitor_display = display;
+	monitor_trace = trace;
+	input_handler = monitor_input;
+	if (numpad_paths)
+		open_pads(pad_paths, numpad_paths);
+
+	while (1) {
+		int evtype;
+		const XIRawEvent *data = next_event(display, &evtype);
+		if (!data) {
+			fflush(stdout);
+			loop_wait(-1);
+			continue;
+		}
+		last_event_time = data->time;
+		last_event_mono = now_ms();
+
+		struct input_change changes[2];
+		size_t numchanges = event_inputs(evtype, data, changes);
+		for (size_t i = 0; i < numchanges; i++)
+			monitor_input(&changes[i], data->time);
+	}
+}
+
+/*
+ * Counters for the whole daemon, reported in the SIGUSR1 snapshot and by
+ * --stress: spawned and live children, and the time hotkey_input() takes to
+ * decide on an input change, in power-of-two buckets of microseconds.
+ */
+#define STATS_LATENCY_BUCKETS 24
+
+static unsigned long child_spawns, input_events;
+static size_t live_children, peak_children;
+static unsigned long input_latency[STATS_LATENCY_BUCKETS];
+
+static pid_t spawn(const char *program, char **env)
+{
+	debug("spawning process %s\n", program);
+	pid_t pid = fork();
+	if (pid == -1)
+		warn("fork() failed: %s\n", strerror(errno));
+	if (!pid) {
+		sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+		sigprocmask(SIG_UNBLOCK, &sigusr1_mask, NULL);
+		for (; env && *env; env++)
+			putenv(*env);
+		execl("/bin/sh", "sh", "-c", program, NULL);
+		exit(0);
+	}
+	if (pid != -1) {
+		loop_child_spawned();
+		child_spawns++;
+		if (++live_children > peak_children)
+			peak_children = live_children;
+	}
+	return pid;
+}
+
+/*
+ * Run the program once for the wheel ticks received since the previous batch,
+ * passing the count in $THOTKEYS_TICKS and the direction-weighted sum in
+ * $THOTKEYS_DELTA. The child is not tracked: it is not tied to the chord.
+ */
+static void accumulate_flush(struct hotkey_config *c, long long now)
+{
+	char ticks[32], delta[32];
+	snprintf(ticks, sizeof(ticks), "THOTKEYS_TICKS=%ld", c->ticks);
+	snprintf(delta, sizeof(delta), "THOTKEYS_DELTA=%ld", c->delta);
+	char *env[] = { ticks, delta, NULL };
+
+	c->spawns++;
+	if (shadow)
+		shadow_log(c, "batch");
+	else
+		spawn(c->on_press, env);
+	c->ticks = c->delta = 0;
+	c->last_flush = now;
+}
+
+static void accumulate_timer(struct timer *t, long long now)
+{
+	accumulate_flush(container_of(t, struct hotkey_config, flush_timer), now);
+}
+
+/*
+ * Count a wheel tick for an accumulating hotkey. The first tick after a quiet
+ * period is delivered at once; later ones are held back so that at most one
+ * batch is spawned per interval.
+ */
+static void accumulate_tick(struct hotkey_config *c, int button)
+{
+	c->ticks++;
+	c->delta += button == 4 || button == 6 ? 1 : -1;
+	if (c->flush_timer.armed)
+		return;
+
+	long long now = now_ms();
+	if (now - c->last_flush >= c->accumulate)
+		accumulate_flush(c, now);
+	else
+		timer_arm(&c->flush_timer, c->last_flush + c->accumulate);
+}
+
+/*
+ * Return 0 if the hotkey may be activated at time t, otherwise the number of
+ * milliseconds until it may. Server time wraps around at 32 bits.
+ */
+static long throttle_check(struct hotkey_config *c, Time t)
+{
+	long wait = 0;
+	if (c->cooldown && c->has_last) {
+		long elapsed = (long)(uint32_t)(t - c->last_activation);
+		if (elapsed < c->cooldown)
+			wait = c->cooldown - elapsed;
+	}
+	if (c->rate_count) {
+		long long elapsed = (uint32_t)(t - c->bucket_stamp);
+		long long capacity = (long long)c->rate_count * c->rate_window;
+		c->credit += elapsed * c->rate_count;
+		if (c->credit > capacity)
+			c->credit = capacity;
+		c->bucket_stamp = t;
+		if (c->credit < c->rate_window) {
+			long long need = c->rate_window - c->credit;
+			long refill = (long)((need + c->rate_count - 1) / c->rate_count);
+			if (refill > wait)
+				wait = refill;
+		}
+	}
+	return wait;
+}
+
+static void throttle_consume(struct hotkey_config *c, Time t)
+{
+	c->has_last = true;
+	c->last_activation = t;
+	if (c->rate_count)
+		c->credit -= c->rate_window;
+}
+
+static void save_state(void);
+
+static void hotkey_spawn(struct hotkey_config *c)
+{
+	c->spawns++;
+	if (shadow) {
+		shadow_log(c, c->wm.op ? "wm" : "spawn");
+		return;
+	}
+	if (c->wm.op) {
+		wm_run(&c->wm);
+		return;
+	}
+	if (c->pid != -1)
+		warn("program '%s' is still running with pid %d\n",
+		     c->on_press, c->pid);
+	c->pid = spawn(c->on_press, NULL);
+	c->adopted = NULL;
+	if (c->pid != -1)
+		save_state();
+}
+
+static void hotkey_signal(struct hotkey_config *c, int sig);
+
+static void hotkey_activate(struct hotkey_config *c, Time t)
+{
+	long wait = throttle_check(c, t);
+	if (wait) {
+		debug("throttled '%s' for %ld ms\n", c->on_press, wait);
+		if (shadow)
+			shadow_log(c, "throttled");
+		c->throttled = true;
+		if (c->coalesce && !c->trailing_timer.armed)
+			timer_arm(&c->trailing_timer, now_ms() + wait);
+		return;
+	}
+	timer_cancel(&c->trailing_timer);
+	throttle_consume(c, t);
+	c->throttled = false;
+	hotkey_spawn(c);
+}
+
+static void hotkey_deactivate(struct hotkey_config *c)
+{
+	if (shadow && !c->throttled && !c->wm.op)
+		shadow_log(c, "terminate");
+	if (c->throttled || c->pid == -1)
+		return;
+	debug("sending SIGTERM to process %d\n", c->pid);
+	hotkey_signal(c, SIGTERM);
+}
+
+/*
+ * The single activation that stands for those dropped by --coalesce. If the
+ * hotkey is still held, the process is terminated on release as usual;
+ * otherwise it is left to run to completion.
+ */
+static void trailing_timer(struct timer *timer, long long now)
+{
+	struct hotkey_config *c = container_of(timer, struct hotkey_config, trailing_timer);
+	if (!hotkey_allowed(c)) {
+		debug("dropped the coalesced '%s', it is blocked now\n", c->on_press);
+		if (shadow)
+			shadow_log(c, "blocked");
+		return;
+	}
+	Time t = current_server_time();
+	long wait = throttle_check(c, t);
+	if (wait) {
+		timer_arm(&c->trailing_timer, now + wait);
+		return;
+	}
+	throttle_consume(c, t);
+	if (c->activated)
+		c->throttled = false;
+	hotkey_spawn(c);
+	if (!c->activated && c->pid != -1) {
+		/* Nothing would terminate it, nor should the next activation warn */
+		c->pid = -1;
+		save_state();
+	}
+	if (c->led || c->bell)
+		hotkey_feedback(c, true);
+}
+
+/*
+ * A latching hotkey toggles on each match instead of following the chord:
+ * <on-press> runs when it latches and <on-unlatch> when it unlatches (or
+ * <on-press> again, with $THOTKEYS_LATCHED=0). Neither process is tracked, so
+ * nothing needs to stay running between the presses.
+ */
+static void hotkey_toggle(struct hotkey_config *c, Time t)
+{
+	long wait = throttle_check(c, t);
+	if (wait) {
+		debug("throttled '%s' for %ld ms\n", c->on_press, wait);
+		if (shadow)
+			shadow_log(c, "throttled");
+		return;
+	}
+	throttle_consume(c, t);
+
+	c->latched = !c->latched;
+	c->spawns++;
+	if (shadow) {
+		shadow_log(c, c->latched ? "latch" : "unlatch");
+		return;
+	}
+	char latched[32];
+	snprintf(latched, sizeof(latched), "THOTKEYS_LATCHED=%d", c->latched);
+	char *env[] = { latched, NULL };
+	spawn(c->latched || !c->on_unlatch ? c->on_press : c->on_unlatch, env);
+}
+
+/*
+ * Compiling hotkeys and building the index is split into ranges of hotkeys
+ * that are processed on worker threads when the configuration is large. The
+ * calling thread takes the first range. Ranges are in ascending hotkey order,
+ * so the results do not depend on the number of threads.
+ */
+#define PARALLEL_MIN_CHUNK 2048
+#define PARALLEL_MAX_THREADS 32
+
+struct work_range {
+	size_t begin, end;
+	size_t thread;
+	void *arg;
+	void (*fn)(struct work_range *);
+};
+
+static size_t parallel_threads(size_t n)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t threads = n / PARALLEL_MIN_CHUNK;
+	if (cpus > 0 && threads > (size_t)cpus)
+		threads = (size_t)cpus;
+	if (threads > PARALLEL_MAX_THREADS)
+		threads = PARALLEL_MAX_THREADS;
+	return threads ? threads : 1;
+}
+
+static void *parallel_worker(void *arg)
+{
+	struct work_range *r = arg;
+	r->fn(r);
+	return NULL;
+}
+
+static void parallel_for(size_t n, size_t threads, void (*fn)(struct work_range *), void *arg)
+{
+	struct work_range ranges[PARALLEL_MAX_THREADS];
+	pthread_t tids[PARALLEL_MAX_THREADS];
+
+	for (size_t t = 0; t < threads; t++) {
+		ranges[t] = (struct work_range) {
+			.begin = n * t / threads,
+			.end = n * (t + 1) / threads,
+			.thread = t,
+			.arg = arg,
+			.fn = fn,
+		};
+	}
+	for (size_t t = 1; t < threads; t++) {
+		if (pthread_create(&tids[t], NULL, parallel_worker, &ranges[t]))
+			fatal("pthread_create() failed\n");
+	}
+	fn(&ranges[0]);
+	for (size_t t = 1; t < threads; t++)
+		pthread_join(tids[t], NULL);
+}
+
+/*
+ * Matchers. An input is identified by its offset in struct hotkey_map. Fed a
+ * press or release of an input, a matcher writes the resulting hotkey state
+ * changes to out, in ascending hotkey order, as (hotkey << 1 | matched).
+ *
+ * The reference matcher is the original algorithm: every hotkey keeps its own
+ * copy of the pressed state and is compared against its definition with
+ * memcmp(). It is kept to check the indexed matcher against, with
+ * --verify-matcher.
+ */
+#define NUM_INPUTS sizeof(struct hotkey_map)
+
+struct reference_matcher {
+	const struct hotkey_config *hotkeys;
+	size_t numhotkeys;
+	struct hotkey_map *keymaps;
+	bool *activated;
+};
+
+static void reference_init(struct reference_matcher *m,
+			   const struct hotkey_config *hotkeys, size_t numhotkeys)
+{
+	m->hotkeys = hotkeys;
+	m->numhotkeys = numhotkeys;
+	m->keymaps = xcalloc(numhotkeys, sizeof(*m->keymaps));
+	m->activated = xcalloc(numhotkeys, sizeof(*m->activated));
+}
+
+static void reference_free(struct reference_matcher *m)
+{
+	free(m->keymaps);
+	free(m->activated);
+}
+
+static size_t reference_feed(struct reference_matcher *m, size_t offset, bool pressed,
+			     uint32_t *out)
+{
+	size_t num = 0;
+	for (size_t i = 0; i < m->numhotkeys; i++) {
+		const struct hotkey_config *c = m->hotkeys + i;
+		if (!*((const char *)&c->checkmap + offset))
+			continue;
+
+		*((char *)&m->keymaps[i] + offset) = pressed;
+		bool matched = !memcmp(&c->checkmap, &m->keymaps[i], sizeof(c->checkmap));
+		if (matched != m->activated[i])
+			out[num++] = (uint32_t)i << 1 | matched;
+		m->activated[i] = matched;
+	}
+	return num;
+}
+
+static bool reference_matched(const struct reference_matcher *m, size_t i)
+{
+	return !memcmp(&m->hotkeys[i].checkmap, &m->keymaps[i], sizeof(m->keymaps[i]));
+}
+
+/*
+ * The indexed matcher. For each input, the hotkeys containing it are listed
+ * in a CSR layout (start[input] .. start[input + 1] into hotkey[]), and each
+ * hotkey counts its members that are not pressed. An event only touches the
+ * hotkeys it is a member of, and a hotkey is matched when its count is zero.
+ */
+struct matcher {
+	uint32_t *start;
+	uint32_t *hotkey;
+	uint32_t *missing;
+	size_t numhotkeys;
+	size_t maxfanout;
+	bool pressed[NUM_INPUTS];
+};
+
+struct matcher_build {
+	const struct hotkey_config *hotkeys;
+	struct matcher *m;
+	uint32_t (*counts)[NUM_INPUTS];
+};
+
+static void matcher_count(struct work_range *r)
+{
+	struct matcher_build *b = r->arg;
+	uint32_t *counts = b->counts[r->thread];
+	for (size_t i = r->begin; i < r->end; i++) {
+		const char *map = (const char *)&b->hotkeys[i].checkmap;
+		for (size_t input = 0; input < NUM_INPUTS; input++) {
+			if (map[input]) {
+				counts[input]++;
+				b->m->missing[i]++;
+			}
+		}
+	}
+}
+
+static void matcher_fill(struct work_range *r)
+{
+	struct matcher_build *b = r->arg;
+	uint32_t *next = b->counts[r->thread];
+	for (size_t i = r->begin; i < r->end; i++) {
+		const char *map = (const char *)&b->hotkeys[i].checkmap;
+		for (size_t input = 0; input < NUM_INPUTS; input++)
+			if (map[input])
+				b->m->hotkey[next[input]++] = (uint32_t)i;
+	}
+}
+
+/*
+ * Each thread counts the members of its range of hotkeys per input, the
+ * counts are merged into the CSR offsets (turning each thread's count into
+ * the position its range starts at for that input), and each thread then
+ * fills in its own part of every list. The finished matcher is copied out at
+ * once.
+ */
+static void matcher_init(struct matcher *m, const struct hotkey_config *hotkeys,
+			 size_t numhotkeys)
+{
+	struct matcher built = { .numhotkeys = numhotkeys };
+	built.start = xcalloc(NUM_INPUTS + 1, sizeof(*built.start));
+	built.missing = xcalloc(numhotkeys + 1, sizeof(*built.missing));
+
+	size_t threads = parallel_threads(numhotkeys);
+	struct matcher_build b = {
+		.hotkeys = hotkeys,
+		.m = &built,
+		.counts = xcalloc(threads, sizeof(*b.counts)),
+	};
+	parallel_for(numhotkeys, threads, matcher_count, &b);
+
+	uint32_t total = 0;
+	for (size_t input = 0; input < NUM_INPUTS; input++) {
+		built.start[input] = total;
+		for (size_t t = 0; t < threads; t++) {
+			uint32_t count = b.counts[t][input];
+			b.counts[t][input] = total;
+			total += count;
+		}
+		if (total - built.start[input] > built.maxfanout)
+			built.maxfanout = total - built.start[input];
+	}
+	built.start[NUM_INPUTS] = total;
+
+	built.hotkey = xcalloc(total + 1, sizeof(*built.hotkey));
+	parallel_for(numhotkeys, threads, matcher_fill, &b);
+	free(b.counts);
+
+	*m = built;
+}
+
+static void matcher_free(struct matcher *m)
+{
+	free(m->start);
+	free(m->hotkey);
+	free(m->missing);
+}
+
+static size_t matcher_feed(struct matcher *m, size_t offset, bool pressed, uint32_t *out)
+{
+	if (m->pressed[offset] == pressed)
+		return 0;
+	m->pressed[offset] = pressed;
+
+	size_t num = 0;
+	for (uint32_t j = m->start[offset]; j < m->start[offset + 1]; j++) {
+		uint32_t i = m->hotkey[j];
+		if (pressed) {
+			if (!--m->missing[i])
+				out[num++] = i << 1 | 1;
+		}
+		else {
+			if (!m->missing[i]++)
+				out[num++] = i << 1;
+		}
+	}
+	return num;
+}
+
+static bool matcher_matched(const struct matcher *m, size_t i)
+{
+	return !m->missing[i];
+}
+
+/*
+ * Keysyms resolved to keycodes, as an open addressing table. XKeysymToKeycode()
+ * scans the whole keyboard mapping and must not be called from several
+ * threads, so every distinct keysym is resolved once, up front.
+ */
+struct keycode_cache {
+	KeySym *keysyms;
+	KeyCode *keycodes;
+	size_t mask;
+};
+
+static size_t keycode_cache_slot(const struct keycode_cache *cache, KeySym keysym)
+{
+	size_t slot = (size_t)(keysym * 0x9e3779b97f4a7c15ull) & cache->mask;
+	while (cache->keysyms[slot] != NoSymbol && cache->keysyms[slot] != keysym)
+		slot = (slot + 1) & cache->mask;
+	return slot;
+}
+
+struct hotkey_build {
+	struct hotkey_config *hotkeys;
+	KeySym *keysyms;
+	size_t *keybase;
+	struct keycode_cache cache;
+};
+
+static void compile_keysyms(struct work_range *r)
+{
+	struct hotkey_build *b = r->arg;
+	for (size_t i = r->begin; i < r->end; i++) {
+		struct hotkey_config *c = b->hotkeys + i;
+		for (size_t j = 0; j < c->numkeystrs; j++)
+			b->keysyms[b->keybase[i] + j] = string_to_keysym(c->keystrs[j]);
+	}
+}
+
+static void compile_checkmaps(struct work_range *r)
+{
+	struct hotkey_build *b = r->arg;
+	for (size_t i = r->begin; i < r->end; i++) {
+		struct hotkey_config *c = b->hotkeys + i;
+		memset(&c->checkmap, 0, sizeof(c->checkmap));
+		c->activated = false;
+		c->pid = -1;
+
+		for (size_t j = 0; j < c->numkeystrs; j++) {
+			KeySym keysym = b->keysyms[b->keybase[i] + j];
+			KeyCode keycode = b->cache.keycodes[keycode_cache_slot(&b->cache, keysym)];
+			c->checkmap.keys[keycode] = 1;
+		}
+		/* Options were checked while parsing; nothing here may fail */
+		for (size_t j = 0; j < c->numbuttonstrs; j++) {
+			long num = strtol(c->buttonstrs[j], NULL, 10);
+			if (c->accumulate && num >= 4 && num <= 7)
+				c->wheelmask |= 1u << num;
+			else
+				c->checkmap.buttons[num] = 1;
+		}
+		if (c->fingers)
+			c->checkmap.fingers[c->fingers] = 1;
+		for (size_t j = 0; j < c->numpadstrs; j++) {
+			int code = pad_button_code(c->padstrs[j]);
+			c->checkmap.pad_buttons[code - PAD_BUTTON_BASE] = 1;
+		}
+		if (c->accumulate) {
+			c->ticks = c->delta = 0;
+			c->last_flush = now_ms() - c->accumulate;
+			c->flush_timer.fire = accumulate_timer;
+		}
+		if (c->rate_count)
+			c->credit = (long long)c->rate_count * c->rate_window;
+		c->trailing_timer.fire = trailing_timer;
+	}
+}
+
+/* The keysyms of all --key options in order, when resolved at build time */
+static const KeySym *preresolved_keysyms;
+
+/*
+ * Resolve the --key and --button strings of the hotkeys into checkmaps. Names
+ * are looked up in the generated keysym table on worker threads; what needs
+ * Xlib (names it does not know, and the keycodes) is done on this thread, once
+ * per distinct name.
+ */
+static void compile_hotkeys(Display *display, struct hotkey_config *hotkeys,
+			    size_t numhotkeys)
+{
+	struct hotkey_build b = {
+		.hotkeys = hotkeys,
+		.keybase = xcalloc(numhotkeys + 1, sizeof(*b.keybase)),
+	};
+	for (size_t i = 0; i < numhotkeys; i++)
+		b.keybase[i + 1] = b.keybase[i] + hotkeys[i].numkeystrs;
+	size_t numkeys = b.keybase[numhotkeys];
+	b.keysyms = xcalloc(numkeys + 1, sizeof(*b.keysyms));
+
+	size_t threads = parallel_threads(numhotkeys);
+	if (preresolved_keysyms)
+		memcpy(b.keysyms, preresolved_keysyms, sizeof(*b.keysyms) * numkeys);
+	else
+		parallel_for(numhotkeys, threads, compile_keysyms, &b);
+
+	size_t size = 16;
+	while (size < numkeys * 2)
+		size *= 2;
+	b.cache.mask = size - 1;
+	b.cache.keysyms = xcalloc(size, sizeof(*b.cache.keysyms));
+	b.cache.keycodes = xcalloc(size, sizeof(*b.cache.keycodes));
+	for (size_t i = 0; i < numhotkeys; i++) {
+		for (size_t j = 0; j < hotkeys[i].numkeystrs; j++) {
+			const char *str = hotkeys[i].keystrs[j];
+			KeySym *keysym = &b.keysyms[b.keybase[i] + j];
+			if (*keysym == NoSymbol)
+				*keysym = XStringToKeysym(str);
+			if (*keysym == NoSymbol)
+				fatal("--key %s could not be recognized\n", str);
+
+			size_t slot = keycode_cache_slot(&b.cache, *keysym);
+			if (b.cache.keysyms[slot] != NoSymbol)
+				continue;
+			KeyCode keycode = XKeysymToKeycode(display, *keysym);
+			if (keycode == 0)
+				fatal("--key %s could not be converted into keycode\n", str);
+			b.cache.keysyms[slot] = *keysym;
+			b.cache.keycodes[slot] = keycode;
+		}
+	}
+
+	parallel_for(numhotkeys, threads, compile_checkmaps, &b);
+
+	free(b.keybase);
+	free(b.keysyms);
+	free(b.cache.keysyms);
+	free(b.cache.keycodes);
+}
+
+static struct matcher matcher;
+static uint32_t *transitions;
+static uint32_t *wheel_hotkeys;
+static size_t numwheel_hotkeys;
+
+static void hotkey_child_exited(pid_t pid, int status)
+{
+	(void)status;
+	if (live_children)
+		live_children--;
+	for (size_t i = 0; i < numrunning_hotkeys; i++) {
+		struct hotkey_config *c = running_hotkeys + i;
+		if (c->pid == pid && !c->adopted) {
+			c->pid = -1;
+			save_state();
+			break;
+		}
+	}
+}
+
+/*
+ * Processes survive a restart of thotkeys. With --state-file, the processes
+ * tied to held hotkeys are recorded with their start time (to tell them from
+ * a later process reusing the pid), and a restarted daemon adopts them:
+ * they are watched through a pidfd, and terminated on release as if they had
+ * been spawned by it. Hotkeys are identified by a hash of their definition.
+ */
+static const char *state_path;
+
+struct adopted {
+	struct watch watch;
+	struct hotkey_config *hotkey;
+	pid_t pid;
+};
+
+static uint64_t hotkey_id(const struct hotkey_config *c)
+{
+	uint64_t h = 14695981039346656037ull;
+#define HASH_STR(str) do { \
+	for (const char *p = (str); p && *p; p++) \
+		h = (h ^ (unsigned char)*p) * 1099511628211ull; \
+	h = (h ^ 0xff) * 1099511628211ull; \
+} while (0)
+	for (size_t i = 0; i < c->numkeystrs; i++)
+		HASH_STR(c->keystrs[i]);
+	HASH_STR("\1");
+	for (size_t i = 0; i < c->numbuttonstrs; i++)
+		HASH_STR(c->buttonstrs[i]);
+	HASH_STR("\1");
+	for (size_t i = 0; i < c->numpadstrs; i++)
+		HASH_STR(c->padstrs[i]);
+	h = (h ^ (uint64_t)c->fingers) * 1099511628211ull;
+	HASH_STR(c->on_press);
+#undef HASH_STR
+	return h;
+}
+
+/* The start time of a process in clock ticks after boot, or 0 */
+static unsigned long long proc_starttime(pid_t pid)
+{
+	char path[64], buf[1024];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+	fclose(fp);
+	buf[len] = '\0';
+
+	/* Skip "pid (comm)", the name may contain spaces and parentheses */
+	char *p = strrchr(buf, ')');
+	unsigned long long starttime;
+	if (!p || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u "
+			 "%*d %*d %*d %*d %*d %*d %llu", &starttime) != 1)
+		return 0;
+	return starttime;
+}
+
+static void save_state(void)
+{
+	if (!state_path)
+		return;
+
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", state_path);
+	FILE *fp = fopen(tmp, "w");
+	if (!fp) {
+		warn("unable to open %s: %s\n", tmp, strerror(errno));
+		return;
+	}
+	for (size_t i = 0; i < numrunning_hotkeys; i++) {
+		const struct hotkey_config *c = running_hotkeys + i;
+		if (c->pid == -1 || c->latch || c->accumulate)
+			continue;
+		unsigned long long starttime = proc_starttime(c->pid);
+		if (starttime)
+			fprintf(fp, "%016llx %d %llu\n", (unsigned long long)hotkey_id(c),
+				c->pid, starttime);
+	}
+	if (fclose(fp) || rename(tmp, state_path))
+		warn("unable to write %s: %s\n", state_path, strerror(errno));
+}
+
+static void hotkey_signal(struct hotkey_config *c, int sig)
+{
+	if (c->adopted) {
+		if (syscall(SYS_pidfd_send_signal, c->adopted->watch.fd, sig, NULL, 0) == -1)
+			debug("pidfd_send_signal() failed: %s\n", strerror(errno));
+		return;
+	}
+	kill(c->pid, sig);
+}
+
+static void adopted_release(struct watch *w)
+{
+	close(w->fd);
+	free(container_of(w, struct adopted, watch));
+}
+
+static void adopted_ready(struct watch *w, ssize_t n)
+{
+	(void)n;
+	struct adopted *a = container_of(w, struct adopted, watch);
+	struct hotkey_config *c = a->hotkey;
+	debug("adopted process %d exited\n", a->pid);
+	if (c->adopted == a) {
+		c->adopted = NULL;
+		c->pid = -1;
+		save_state();
+	}
+	loop_watch_remove(w);
+}
+
+static void stats_transition(struct hotkey_config *c, bool matched, long long now);
+
+/*
+ * Mark an input as held at startup; hotkeys it completes are not run, but
+ * are counted, and light their --led if their process was adopted.
+ */
+static void hotkey_seed(size_t offset)
+{
+	size_t num = matcher_feed(&matcher, offset, true, transitions);
+	for (size_t j = 0; j < num; j++) {
+		struct hotkey_config *c = running_hotkeys + (transitions[j] >> 1);
+		bool matched = transitions[j] & 1;
+		stats_transition(c, matched, now_ms());
+		c->activated = matched;
+		c->throttled = !c->adopted;
+		if (c->led)
+			hotkey_feedback(c, false);
+	}
+}
+
+/*
+ * Adopt the processes recorded in the state file by a previous instance,
+ * then terminate those whose hotkeys were released in the meantime. This
+ * needs to know what is held now; keys and pointer buttons are queried from
+ * the server and fed to the matcher, without activating anything.
+ */
+static void adopt_children(Display *display)
+{
+	FILE *fp = fopen(state_path, "r");
+	if (!fp) {
+		if (errno != ENOENT)
+			warn("unable to open %s: %s\n", state_path, strerror(errno));
+		return;
+	}
+
+	uint64_t *ids = xcalloc(numrunning_hotkeys + 1, sizeof(*ids));
+	for (size_t i = 0; i < numrunning_hotkeys; i++)
+		ids[i] = hotkey_id(running_hotkeys + i);
+
+	unsigned long long id, starttime;
+	int pid;
+	while (fscanf(fp, "%llx %d %llu", &id, &pid, &starttime) == 3) {
+		if (pid <= 0 || proc_starttime(pid) != starttime)
+			continue;
+		size_t i;
+		for (i = 0; i < numrunning_hotkeys; i++)
+			if (ids[i] == id && running_hotkeys[i].pid == -1)
+				break;
+		if (i == numrunning_hotkeys) {
+			debug("process %d belongs to no hotkey, leaving it alone\n", pid);
+			continue;
+		}
+
+		int fd = (int)syscall(SYS_pidfd_open, pid, 0);
+		if (fd == -1) {
+			warn("unable to adopt process %d: pidfd_open() failed: %s\n",
+			     pid, strerror(errno));
+			continue;
+		}
+		struct adopted *a = xcalloc(1, sizeof(*a));
+		*a = (struct adopted) {
+			.watch = { .fd = fd, .ready = adopted_ready, .release = adopted_release },
+			.hotkey = running_hotkeys + i,
+			.pid = pid,
+		};
+		running_hotkeys[i].pid = pid;
+		running_hotkeys[i].adopted = a;
+		loop_watch_add(&a->watch);
+		debug("adopted process %d of '%s'\n", pid, running_hotkeys[i].on_press);
+	}
+	fclose(fp);
+	free(ids);
+
+	char keys[32];
+	XQueryKeymap(display, keys);
+	for (size_t k = 0; k < 256; k++) {
+		if (!(keys[k / 8] & 1 << k % 8))
+			continue;
+		hotkey_seed(offsetof(struct hotkey_map, keys) + k);
+	}
+
+	int pointer;
+	Window root, child;
+	double rx, ry, wx, wy;
+	XIButtonState buttons;
+	XIModifierState mods;
+	XIGroupState group;
+	if (XIGetClientPointer(display, None, &pointer) &&
+	    XIQueryPointer(display, pointer, DefaultRootWindow(display), &root, &child,
+			   &rx, &ry, &wx, &wy, &buttons, &mods, &group)) {
+		for (int b = 1; b < buttons.mask_len * 8 && b < 256; b++) {
+			if (!(buttons.mask[b / 8] & 1 << b % 8))
+				continue;
+			hotkey_seed(offsetof(struct hotkey_map, buttons) + (size_t)b);
+		}
+		XFree(buttons.mask);
+	}
+
+	for (size_t i = 0; i < numrunning_hotkeys; i++) {
+		struct hotkey_config *c = running_hotkeys + i;
+		if (c->adopted && !c->activated) {
+			debug("'%s' was released while thotkeys was not running\n", c->on_press);
+			hotkey_signal(c, SIGTERM);
+		}
+	}
+	save_state();
+}
+
+/*
+ * A snapshot of the hotkeys' state, written on SIGUSR1 to --stats-file (through
+ * a temporary file and rename()) or to stderr.
+ */
+static const char *stats_path;
+
+static void json_string(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+	for (; *str; str++) {
+		unsigned char ch = (unsigned char)*str;
+		if (ch == '"' || ch == '\\')
+			fprintf(fp, "\\%c", ch);
+		else if (ch < 0x20)
+			fprintf(fp, "\\u%04x", ch);
+		else
+			fputc(ch, fp);
+	}
+	fputc('"', fp);
+}
+
+/* The power-of-two bucket of a duration: 0 for 0, i for [2^(i-1), 2^i) */
+static size_t stats_bucket(long long value, size_t num)
+{
+	size_t bucket = 0;
+	while (value > 0 && bucket < num - 1) {
+		value >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+/* Bring the hourly ring of the hotkey up to the current hour. */
+static void stats_advance(struct hotkey_config *c, long long hour)
+{
+	if (hour - c->hour >= STATS_HOURS)
+		memset(c->hourly, 0, sizeof(c->hourly));
+	else
+		for (long long h = c->hour + 1; h <= hour; h++)
+			c->hourly[h % STATS_HOURS] = 0;
+	if (hour > c->hour)
+		c->hour = hour;
+}
+
+static void stats_transition(struct hotkey_config *c, bool matched, long long now)
+{
+	if (matched) {
+		c->matched_at = now;
+		c->matches++;
+		stats_advance(c, now / 3600000);
+		c->hourly[c->hour % STATS_HOURS]++;
+		return;
+	}
+
+	c->holds[stats_bucket(now - c->matched_at, STATS_HOLD_BUCKETS)]++;
+	if (!c->latch && !c->accumulate && !c->throttled && c->pid != -1)
+		c->running_at_release++;
+}
+
+/*
+ * hold_ms[i] counts holds shorter than 2^i ms (and at least 2^(i-1) ms), and
+ * latency_us[i] likewise; per_hour ends with the current hour.
+ */
+static size_t stats_buckets(const unsigned long *buckets, size_t num)
+{
+	while (num && !buckets[num - 1])
+		num--;
+	return num;
+}
+
+static void print_stats(FILE *fp)
+{
+	long long hour = now_ms() / 3600000;
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	fprintf(fp, "{\"cpu_user_ms\":%ld,\"cpu_system_ms\":%ld",
+		usage.ru_utime.tv_sec * 1000 + usage.ru_utime.tv_usec / 1000,
+		usage.ru_stime.tv_sec * 1000 + usage.ru_stime.tv_usec / 1000);
+	fprintf(fp, ",\"events\":%lu,\"spawns\":%lu,\"live_children\":%zu,\"peak_children\":%zu",
+		input_events, child_spawns, live_children, peak_children);
+	fprintf(fp, ",\"latency_us\":[");
+	for (size_t j = 0; j < stats_buckets(input_latency, STATS_LATENCY_BUCKETS); j++)
+		fprintf(fp, "%s%lu", j ? "," : "", input_latency[j]);
+	fprintf(fp, "],\n\"hotkeys\":[");
+	for (size_t i = 0; i < numrunning_hotkeys; i++) {
+		const struct hotkey_config *c = running_hotkeys + i;
+		fprintf(fp, "%s\n{\"on_press\":", i ? "," : "");
+		json_string(fp, c->on_press);
+		fprintf(fp, ",\"active\":%s", c->activated ? "true" : "false");
+		if (c->latch)
+			fprintf(fp, ",\"latched\":%s", c->latched ? "true" : "false");
+		fprintf(fp, ",\"running\":%s", c->pid != -1 ? "true" : "false");
+		fprintf(fp, ",\"matches\":%lu,\"spawns\":%lu,\"running_at_release\":%lu",
+			c->matches, c->spawns, c->running_at_release);
+
+		fprintf(fp, ",\"hold_ms\":[");
+		for (size_t j = 0; j < stats_buckets(c->holds, STATS_HOLD_BUCKETS); j++)
+			fprintf(fp, "%s%lu", j ? "," : "", c->holds[j]);
+
+		stats_advance(running_hotkeys + i, hour);
+		fprintf(fp, "],\"per_hour\":[");
+		for (long long h = hour - STATS_HOURS + 1; h <= hour; h++)
+			fprintf(fp, "%s%lu", h > hour - STATS_HOURS + 1 ? "," : "",
+				h < 0 ? 0 : c->hourly[h % STATS_HOURS]);
+		fprintf(fp, "]}");
+	}
+	fprintf(fp, "\n]}\n");
+}
+
+static void write_stats(void)
+{
+	if (!stats_path) {
+		print_stats(stderr);
+		return;
+	}
+
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", stats_path);
+	FILE *fp = fopen(tmp, "w");
+	if (!fp) {
+		warn("unable to open %s: %s\n", tmp, strerror(errno));
+		return;
+	}
+	print_stats(fp);
+	if (fclose(fp) || rename(tmp, stats_path))
+		warn("unable to write %s: %s\n", stats_path, strerror(errno));
+}
+
+static void sigusr1_ready(struct watch *w, ssize_t n)
+{
+	(void)w;
+	if (n > 0)
+		write_stats();
+}
+
+static struct signalfd_siginfo sigusr1_info;
+static struct watch sigusr1_watch = {
+	.fd = -1,
+	.buf = &sigusr1_info,
+	.len = sizeof(sigusr1_info),
+	.ready = sigusr1_ready,
+};
+
+static void stats_init(void)
+{
+	sigemptyset(&sigusr1_mask);
+	sigaddset(&sigusr1_mask, SIGUSR1);
+	if (sigprocmask(SIG_BLOCK, &sigusr1_mask, NULL))
+		fatal("sigprocmask() failed: %s\n", strerror(errno));
+	sigusr1_watch.fd = signalfd(-1, &sigusr1_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sigusr1_watch.fd == -1)
+		fatal("signalfd() failed: %s\n", strerror(errno));
+	loop_watch_add(&sigusr1_watch);
+}
+
+/*
+ * With --defer, a hotkey whose chord is a strict prefix of another one's
+ * (Super and Super+Tab) is not dispatched as soon as it matches. It waits for
+ * up to the window: a longer chord matching supersedes it for the rest of the
+ * hold, even if that one is blocked by its conditions, as the user did press
+ * it. The window expiring, an input that no longer leads to a longer chord,
+ * or releasing the prefix dispatches it, if it is still allowed then.
+ */
+static long defer_window;
+static uint32_t *deferred_hotkeys;
+static size_t numdeferred;
+
+static void defer_timer(struct timer *timer, long long now);
+
+static void defer_init(struct hotkey_config *hotkeys, size_t numhotkeys)
+{
+	for (size_t a = 0; a < numhotkeys; a++) {
+		const char *amap = (const char *)&hotkeys[a].checkmap;
+		if (hotkeys[a].accumulate)
+			continue;
+
+		/* Any longer chord also lists the least shared input of this one */
+		size_t rarest = NUM_INPUTS;
+		for (size_t input = 0; input < NUM_INPUTS; input++)
+			if (amap[input] && (rarest == NUM_INPUTS ||
+			    matcher.start[input + 1] - matcher.start[input] <
+			    matcher.start[rarest + 1] - matcher.start[rarest]))
+				rarest = input;
+		if (rarest == NUM_INPUTS)
+			continue;
+
+		for (uint32_t j = matcher.start[rarest]; j < matcher.start[rarest + 1]; j++) {
+			struct hotkey_config *b = hotkeys + matcher.hotkey[j];
+			const char *bmap = (const char *)&b->checkmap;
+			if (b->accumulate)
+				continue;
+			bool subset = true, longer = false;
+			for (size_t input = 0; input < NUM_INPUTS; input++) {
+				subset &= !amap[input] || bmap[input];
+				longer |= bmap[input] && !amap[input];
+			}
+			if (!subset || !longer)
+				continue;
+
+			b->prefixes = xrealloc(b->prefixes, sizeof(*b->prefixes) * (b->numprefixes + 1));
+			b->prefixes[b->numprefixes++] = (uint32_t)a;
+			if (!hotkeys[a].extensions)
+				hotkeys[a].extensions = xcalloc(1, sizeof(*hotkeys[a].extensions));
+			for (size_t input = 0; input < NUM_INPUTS; input++)
+				((char *)hotkeys[a].extensions)[input] |= bmap[input];
 		}
+		hotkeys[a].defer_timer.fire = defer_timer;
+	}
+	deferred_hotkeys = xcalloc(numhotkeys + 1, sizeof(*deferred_hotkeys));
+}
 
-		int evtype;
-		const XIRawEvent *data = process_event(display, &evtype);
-		bool pressed;
-		ptrdiff_t offset;
+static void defer_begin(struct hotkey_config *c)
+{
+	debug("deferring '%s' for %ld ms\n", c->on_press, defer_window);
+	if (shadow)
+		shadow_log(c, "defer");
+	c->deferred = true;
+	deferred_hotkeys[numdeferred++] = (uint32_t)(c - running_hotkeys);
+	timer_arm(&c->defer_timer, now_ms() + defer_window);
+}
 
-		switch (evtype) {
-		case XI_RawKeyPress:
-		case XI_RawKeyRelease:
-			if (data->detail > 255)
-				fatal("unexpected keycode %d\n", data->detail);
-			pressed = evtype == XI_RawKeyPress;
-			offset = offsetof(struct hotkey_map, keys) + (size_t)data->detail;
+static void defer_end(struct hotkey_config *c)
+{
+	c->deferred = false;
+	timer_cancel(&c->defer_timer);
+	for (size_t i = 0; i < numdeferred; i++) {
+		if (running_hotkeys + deferred_hotkeys[i] == c) {
+			deferred_hotkeys[i] = deferred_hotkeys[--numdeferred];
 			break;
-		case XI_RawButtonPress:
-		case XI_RawButtonRelease:
-			if (data->detail > 255)
-				fatal("unexpected button number %d\n", data->detail);
-			pressed = evtype == XI_RawButtonPress;
-			offset = offsetof(struct hotkey_map, buttons) + (size_t)data->detail;
+		}
+	}
+}
+
+/* The chord was resolved to this hotkey: dispatch it as on a match. */
+static void defer_dispatch(struct hotkey_config *c, Time t)
+{
+	defer_end(c);
+	if (!hotkey_allowed(c)) {
+		debug("'%s' is blocked by a condition or the keyboard state\n", c->on_press);
+		if (shadow)
+			shadow_log(c, "blocked");
+		c->throttled = true;
+	}
+	else if (c->latch)
+		hotkey_toggle(c, t);
+	else
+		hotkey_activate(c, t);
+}
+
+static void defer_resolve(struct hotkey_config *c, Time t)
+{
+	bool latched = c->latched;
+	defer_dispatch(c, t);
+	if (c->led || c->bell)
+		hotkey_feedback(c, c->latch ? c->latched != latched : !c->throttled);
+}
+
+static void defer_timer(struct timer *timer, long long now)
+{
+	(void)now;
+	struct hotkey_config *c = container_of(timer, struct hotkey_config, defer_timer);
+	defer_resolve(c, current_server_time());
+}
+
+/* A longer chord matched: its pending prefixes are dropped until released. */
+static void defer_supersede(struct hotkey_config *c)
+{
+	for (size_t i = 0; i < c->numprefixes; i++) {
+		struct hotkey_config *p = running_hotkeys + c->prefixes[i];
+		if (!p->deferred)
+			continue;
+		debug("'%s' is superseded by '%s'\n", p->on_press, c->on_press);
+		if (shadow)
+			shadow_log(p, "superseded");
+		defer_end(p);
+		p->superseded = true;
+	}
+}
+
+/* Feed one input change from any source to the hotkeys. */
+static void hotkey_input(const struct input_change *change, Time time)
+{
+	/* Latency is counted from when the loop found the input */
+	if (!loop_woken)
+		loop_woken = now_us();
+	long long begin = input_begin = loop_woken;
+	struct hotkey_config *hotkeys = running_hotkeys;
+	size_t button = change->offset - offsetof(struct hotkey_map, buttons);
+	if (change->pressed && button >= 4 && button <= 7) {
+		for (size_t k = 0; k < numwheel_hotkeys; k++) {
+			struct hotkey_config *c = hotkeys + wheel_hotkeys[k];
+			if (c->wheelmask & 1u << button &&
+			    matcher_matched(&matcher, wheel_hotkeys[k]) && hotkey_allowed(c))
+				accumulate_tick(c, (int)button);
+		}
+	}
+
+	size_t num = matcher_feed(&matcher, change->offset, change->pressed, transitions);
+	for (size_t k = 0; k < num; k++) {
+		struct hotkey_config *c = hotkeys + (transitions[k] >> 1);
+		bool matched = transitions[k] & 1;
+		bool latched = c->latched;
+		stats_transition(c, matched, now_ms());
+		if (c->accumulate)
+			continue;
+
+		bool blocked = matched && !hotkey_allowed(c), tapped = false;
+		if (blocked) {
+			debug("'%s' is blocked by a condition or the keyboard state\n", c->on_press);
+			if (shadow)
+				shadow_log(c, "blocked");
+			c->throttled = true;
+		}
+		else if (matched && defer_window && c->extensions)
+			defer_begin(c);
+		else if (!matched && (c->deferred || c->superseded)) {
+			/* Released before the chord was resolved: it was this one */
+			tapped = c->deferred;
+			c->superseded = false;
+			if (tapped) {
+				defer_dispatch(c, time);
+				if (!c->latch)
+					hotkey_deactivate(c);
+			}
+		}
+		else if (c->latch) {
+			if (matched)
+				hotkey_toggle(c, time);
+		}
+		else if (matched)
+			hotkey_activate(c, time);
+		else
+			hotkey_deactivate(c);
+		if (matched && c->numprefixes)
+			defer_supersede(c);
+		c->activated = matched;
+		if (c->led || c->bell)
+			hotkey_feedback(c, c->latch ? c->latched != latched :
+					(matched || tapped) && !c->throttled && !c->deferred);
+	}
+
+	/* A press outside every longer chord resolves to the prefix */
+	for (size_t k = numdeferred; change->pressed && k-- > 0;) {
+		struct hotkey_config *c = hotkeys + deferred_hotkeys[k];
+		if (!*((const char *)c->extensions + change->offset))
+			defer_resolve(c, time);
+	}
+	input_events++;
+	input_latency[stats_bucket(now_us() - begin, STATS_LATENCY_BUCKETS)]++;
+	input_begin = 0;
+}
+
+/* Set up everything command_hotkeys() needs before its main loop. */
+static Display *hotkeys_init(const char *device_name, const char **pad_paths,
+			     size_t numpad_paths, struct hotkey_config *hotkeys,
+			     size_t numhotkeys)
+{
+	/*
+	 * Events are selected first, so that nothing typed from then on is
+	 * lost; the rest of startup runs while the server queues events.
+	 */
+	bool touch = false, pads = false, buttons = false;
+	for (size_t i = 0; i < numhotkeys; i++) {
+		touch |= hotkeys[i].fingers != 0;
+		pads |= hotkeys[i].numpadstrs != 0;
+		buttons |= hotkeys[i].numbuttonstrs != 0;
+	}
+
+	Display *display = get_display();
+	startup_phase("connect");
+	prepare_monitor(display, touch, touch, buttons);
+	startup_phase("select");
+
+	loop_init();
+	running_hotkeys = hotkeys;
+	numrunning_hotkeys = numhotkeys;
+	child_handler = hotkey_child_exited;
+	stats_init();
+
+	compile_hotkeys(display, hotkeys, numhotkeys);
+	startup_phase("keysyms");
+
+	matcher_init(&matcher, hotkeys, numhotkeys);
+	if (defer_window)
+		defer_init(hotkeys, numhotkeys);
+	startup_phase("index");
+
+	resolve_device(display, device_name);
+	if (buttons)
+		load_button_maps(display, XIAllDevices);
+	check_button_bindings(hotkeys, numhotkeys);
+	startup_phase("devices");
+	if (pads) {
+		open_pads(pad_paths, numpad_paths);
+		startup_phase("pads");
+	}
+	if (numconditions) {
+		conditions_init();
+		startup_phase("conditions");
+	}
+
+	transitions = xcalloc(matcher.maxfanout + 1, sizeof(*transitions));
+	wheel_hotkeys = xcalloc(numhotkeys + 1, sizeof(*wheel_hotkeys));
+	for (size_t i = 0; i < numhotkeys; i++)
+		if (hotkeys[i].wheelmask)
+			wheel_hotkeys[numwheel_hotkeys++] = (uint32_t)i;
+	for (size_t i = 0; i < numhotkeys; i++) {
+		if (hotkeys[i].wm.op) {
+			wm_init(display);
+			startup_phase("wm");
+			break;
+		}
+	}
+	for (size_t i = 0; i < numhotkeys; i++) {
+		if (hotkeys[i].led || hotkeys[i].bell) {
+			feedback_init(display, hotkeys, numhotkeys);
+			startup_phase("feedback");
 			break;
-		default:
-			fatal("unreachable\n");
 		}
+	}
+	for (size_t i = 0; i < numhotkeys; i++) {
+		if (hotkeys[i].numwhenstrs) {
+			xkb_state_init(display, hotkeys, numhotkeys);
+			startup_phase("xkb state");
+			break;
+		}
+	}
+	if (state_path) {
+		adopt_children(display);
+		startup_phase("adopt");
+	}
+	input_handler = hotkey_input;
+	startup_phase("ready");
+	return display;
+}
 
-		for (size_t i = 0; i < numhotkeys; i++) {
-			struct hotkey_config *c = hotkeys + i;
-			if (!*((char *)&c->checkmap + offset))
-				continue;
+static void command_hotkeys(const char *device_name, const char **pad_paths,
+			    size_t numpad_paths, struct hotkey_config *hotkeys,
+			    size_t numhotkeys)
+{
+	Display *display = hotkeys_init(device_name, pad_paths, numpad_paths,
+					hotkeys, numhotkeys);
+	while (1) {
+		int evtype;
+		const XIRawEvent *data = next_event(display, &evtype);
+		if (!data) {
+			if (shadow)
+				fflush(stdout);
+			loop_wait(run_timers());
+			continue;
+		}
+		last_event_time = data->time;
+		last_event_mono = now_ms();
+
+		struct input_change changes[2];
+		size_t numchanges = event_inputs(evtype, data, changes);
+		for (size_t i = 0; i < numchanges; i++)
+			hotkey_input(&changes[i], data->time);
+	}
+}
+
+/* xorshift64*, so that --verify-matcher runs are reproducible from the seed */
+static uint64_t verify_random(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545f4914f6cdd1dull;
+}
+
+struct trace_event {
+	size_t offset;
+	bool pressed;
+};
+
+/*
+ * Read a trace as printed by 'thotkeys --monitor --trace': one event per line,
+ * "<time> key|button|fingers|pad press|release <detail>". Lines starting with '#' are
+ * ignored.
+ */
+static struct trace_event *read_trace(const char *path, size_t *numevents)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		fatal("unable to open %s: %s\n", path, strerror(errno));
+
+	struct trace_event *events = NULL;
+	size_t num = 0, lineno = 0;
+	char line[256], kind[16], action[16];
+	unsigned long time;
+	int detail;
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%lu %15s %15s %d", &time, kind, action, &detail) != 4 ||
+		    detail < 0 ||
+		    strcmp(action, "press") && strcmp(action, "release"))
+			fatal("%s:%zu: malformed trace event\n", path, lineno);
+
+		size_t base;
+		if (!strcmp(kind, "key") && detail <= 255)
+			base = offsetof(struct hotkey_map, keys);
+		else if (!strcmp(kind, "button") && detail <= 255)
+			base = offsetof(struct hotkey_map, buttons);
+		else if (!strcmp(kind, "fingers") && detail <= MAX_FINGERS)
+			base = offsetof(struct hotkey_map, fingers);
+		else if (!strcmp(kind, "pad") && detail >= PAD_BUTTON_BASE &&
+			 detail < PAD_BUTTON_BASE + PAD_BUTTONS)
+			base = offsetof(struct hotkey_map, pad_buttons) - PAD_BUTTON_BASE;
+		else
+			fatal("%s:%zu: unknown input '%s %d'\n", path, lineno, kind, detail);
+
+		events = xrealloc(events, sizeof(*events) * (num + 1));
+		events[num++] = (struct trace_event) {
+			.offset = base + (size_t)detail,
+			.pressed = !strcmp(action, "press"),
+		};
+	}
+	fclose(fp);
+	*numevents = num;
+	return events;
+}
+
+/*
+ * Run events through both matchers and return the index of the first event on
+ * which they disagree, either in the transitions they report or in the
+ * matched state of any hotkey, or numevents if they agree throughout.
+ */
+static size_t verify_trace(const struct hotkey_config *hotkeys, size_t numhotkeys,
+			   const struct trace_event *events, size_t numevents)
+{
+	struct reference_matcher ref;
+	struct matcher fast;
+	reference_init(&ref, hotkeys, numhotkeys);
+	matcher_init(&fast, hotkeys, numhotkeys);
+	uint32_t *expected = xcalloc(numhotkeys + 1, sizeof(*expected));
+	uint32_t *actual = xcalloc(numhotkeys + 1, sizeof(*actual));
+
+	size_t i;
+	for (i = 0; i < numevents; i++) {
+		const struct trace_event *ev = &events[i];
+		size_t nexpected = reference_feed(&ref, ev->offset, ev->pressed, expected);
+		size_t nactual = matcher_feed(&fast, ev->offset, ev->pressed, actual);
+
+		bool same = nexpected == nactual &&
+			!memcmp(expected, actual, sizeof(*expected) * nexpected);
+		for (size_t j = 0; same && j < numhotkeys; j++)
+			same = reference_matched(&ref, j) == matcher_matched(&fast, j);
+		if (same)
+			continue;
+
+		int detail;
+		const char *kind = input_kind(ev->offset, &detail);
+		fprintf(stderr, "divergence at event %zu (%s %s %d)\n", i,
+			ev->pressed ? "press" : "release", kind, detail);
+		fprintf(stderr, "  reference:");
+		for (size_t j = 0; j < nexpected; j++)
+			fprintf(stderr, " hotkey %u %s", expected[j] >> 1,
+				expected[j] & 1 ? "activated" : "deactivated");
+		fprintf(stderr, "\n  indexed:  ");
+		for (size_t j = 0; j < nactual; j++)
+			fprintf(stderr, " hotkey %u %s", actual[j] >> 1,
+				actual[j] & 1 ? "activated" : "deactivated");
+		fprintf(stderr, "\n");
+		break;
+	}
+
+	free(expected);
+	free(actual);
+	reference_free(&ref);
+	matcher_free(&fast);
+	return i;
+}
+
+/*
+ * Random hotkeys over a small pool of inputs, so that chords overlap, share
+ * prefixes and repeat, and random traces that press and release those inputs
+ * (including repeated presses and releases of inputs that are not held).
+ */
+#define VERIFY_POOL 27
+
+static size_t verify_pool_offset(size_t n)
+{
+	if (n < VERIFY_POOL - 12)
+		return offsetof(struct hotkey_map, keys) + 8 + n;
+	if (n < VERIFY_POOL - 6)
+		return offsetof(struct hotkey_map, buttons) + 1 + n - (VERIFY_POOL - 12);
+	if (n < VERIFY_POOL - 3)
+		return offsetof(struct hotkey_map, fingers) + 1 + n - (VERIFY_POOL - 6);
+	return offsetof(struct hotkey_map, pad_buttons) + (BTN_SOUTH - PAD_BUTTON_BASE) +
+	       n - (VERIFY_POOL - 3);
+}
+
+static void random_hotkeys(uint64_t *rng, struct hotkey_config *hotkeys, size_t numhotkeys)
+{
+	for (size_t i = 0; i < numhotkeys; i++) {
+		memset(&hotkeys[i], 0, sizeof(hotkeys[i]));
+		size_t members = 1 + verify_random(rng) % 4;
+		for (size_t j = 0; j < members; j++) {
+			size_t offset = verify_pool_offset(verify_random(rng) % VERIFY_POOL);
+			*((char *)&hotkeys[i].checkmap + offset) = 1;
+		}
+	}
+}
+
+static void random_trace(uint64_t *rng, struct trace_event *events, size_t numevents)
+{
+	bool held[VERIFY_POOL] = { 0 };
+	for (size_t i = 0; i < numevents; i++) {
+		size_t n = verify_random(rng) % VERIFY_POOL;
+		bool pressed = verify_random(rng) % 8 ? !held[n] : held[n];
+		held[n] = pressed;
+		events[i] = (struct trace_event) {
+			.offset = verify_pool_offset(n),
+			.pressed = pressed,
+		};
+	}
+}
+
+static void command_verify(const char *trace_path, uint64_t seed, long rounds,
+			   struct hotkey_config *hotkeys, size_t numhotkeys)
+{
+	if (numhotkeys) {
+		Display *display = get_display();
+		compile_hotkeys(display, hotkeys, numhotkeys);
+	}
+
+	struct trace_event *events = NULL;
+	size_t numevents = 0;
+	if (trace_path) {
+		events = read_trace(trace_path, &numevents);
+		rounds = 1;
+	}
+
+	uint64_t rng = seed ? seed : 1;
+	struct hotkey_config *random = NULL;
+	size_t total = 0;
+	for (long round = 0; round < rounds; round++) {
+		uint64_t round_seed = rng;
+		const struct hotkey_config *set = hotkeys;
+		size_t numset = numhotkeys;
+		/* Now and then, enough hotkeys to build the index in parallel */
+		bool large = round % 256 == 255;
+		if (!numhotkeys) {
+			numset = large ? PARALLEL_MIN_CHUNK * 2 + verify_random(&rng) % 16384 :
+				1 + verify_random(&rng) % 64;
+			random = xrealloc(random, sizeof(*random) * numset);
+			random_hotkeys(&rng, random, numset);
+			set = random;
+		}
+		if (!trace_path) {
+			numevents = 1 + verify_random(&rng) % (large ? 256 : 4096);
+			events = xrealloc(events, sizeof(*events) * numevents);
+			random_trace(&rng, events, numevents);
+		}
 
-			*((char *)&c->keymap + offset) = pressed;
-			bool matched = !memcmp(&c->checkmap, &c->keymap, sizeof(c->checkmap));
-
-			if (!c->activated && matched) {
-				if (c->pid != -1)
-					warn("program '%s' is still running with pid %d\n",
-					     c->on_press, c->pid);
-				debug("spawning process %s\n", c->on_press);
-				if (!(c->pid = fork())) {
-					execl("/bin/sh", "sh", "-c", c->on_press, NULL);
-					exit(0);
-				}
+		if (verify_trace(set, numset, events, numevents) != numevents)
+			fatal("matchers diverged in round %ld with %zu hotkeys, " \
+			      "reproduce with --seed %llu --rounds 1\n",
+			      round, numset, (unsigned long long)round_seed);
+		total += numevents;
+	}
+	printf("matchers agree: %ld rounds, %zu events\n", rounds, total);
+	free(events);
+	free(random);
+	exit(0);
+}
+
+/*
+ * Adversarial input for --stress. A pattern is "<name>[:<param>=<value>,...]"
+ * or the path of a trace. Keys are keycodes base, base+1, ... and events are
+ * rate per second apart.
+ *
+ *   mash   random presses and releases over <keys> keys
+ *   stuck  key <base> held throughout while button <button> is clicked
+ *   wheel  <keys> keys held throughout while buttons 4 and 5 are clicked
+ */
+struct stress_params {
+	const char *name;
+	long events, keys, base, button, rate;
+};
+
+static void parse_stress(const char *spec, struct stress_params *p)
+{
+	*p = (struct stress_params) {
+		.events = 100000, .keys = 20, .base = 24, .button = 1, .rate = 1000,
+	};
+	char *str = strdup(spec), *params = strchr(str, ':');
+	if (params)
+		*params++ = '\0';
+	p->name = str;
+	if (strcmp(str, "mash") && strcmp(str, "stuck") && strcmp(str, "wheel")) {
+		p->name = spec;
+		return;
+	}
+	if (!strcmp(str, "wheel"))
+		p->keys = 2;
+
+	for (char *param = params ? strtok(params, ",") : NULL; param; param = strtok(NULL, ",")) {
+		char *eq = strchr(param, '='), *endp;
+		long *field = NULL;
+		if (eq)
+			*eq++ = '\0';
+		if (!strcmp(param, "events"))
+			field = &p->events;
+		else if (!strcmp(param, "keys"))
+			field = &p->keys;
+		else if (!strcmp(param, "base"))
+			field = &p->base;
+		else if (!strcmp(param, "button"))
+			field = &p->button;
+		else if (!strcmp(param, "rate"))
+			field = &p->rate;
+		if (!field || !eq)
+			fatal("--stress %s: unknown parameter '%s'\n", spec, param);
+		*field = strtol(eq, &endp, 10);
+		if (endp == eq || *endp || *field < 0)
+			fatal("--stress %s: invalid %s\n", spec, param);
+	}
+	if (p->keys < 1 || p->base < 8 || p->base + p->keys > 256 ||
+	    p->button < 1 || p->button > 255)
+		fatal("--stress %s: keys or buttons out of range\n", spec);
+}
+
+static struct trace_event *stress_events(const struct stress_params *p, uint64_t seed,
+					 size_t *numevents)
+{
+	if (strcmp(p->name, "mash") && strcmp(p->name, "stuck") && strcmp(p->name, "wheel"))
+		return read_trace(p->name, numevents);
+
+	size_t keys = offsetof(struct hotkey_map, keys) + (size_t)p->base;
+	size_t buttons = offsetof(struct hotkey_map, buttons);
+	size_t num = (size_t)p->events, n = 0;
+	size_t held = !strcmp(p->name, "mash") ? 0 : !strcmp(p->name, "stuck") ? 1 : (size_t)p->keys;
+	struct trace_event *events = xcalloc(num + 2 * held + 256, sizeof(*events));
+	bool down[256] = { 0 };
+	uint64_t rng = seed ? seed : 1;
+
+	for (size_t i = 0; i < held; i++)
+		events[n++] = (struct trace_event) { keys + i, true };
+	while (n < num + held) {
+		if (!strcmp(p->name, "mash")) {
+			size_t k = verify_random(&rng) % (size_t)p->keys;
+			down[k] = !down[k];
+			events[n++] = (struct trace_event) { keys + k, down[k] };
+		}
+		else {
+			size_t b = !strcmp(p->name, "stuck") ? (size_t)p->button :
+				   4 + (verify_random(&rng) >> 32) % 2;
+			events[n++] = (struct trace_event) { buttons + b, true };
+			events[n++] = (struct trace_event) { buttons + b, false };
+		}
+	}
+	for (size_t k = 0; k < 256; k++)
+		if (down[k])
+			events[n++] = (struct trace_event) { keys + k, false };
+	for (size_t i = 0; i < held; i++)
+		events[n++] = (struct trace_event) { keys + i, false };
+	*numevents = n;
+	return events;
+}
+
+#ifdef HAVE_XTEST
+/* Send the events to the X server (e.g. an Xvfb running the daemon under test) */
+static void stress_inject(const struct stress_params *p, const struct trace_event *events,
+			  size_t numevents)
+{
+	Display *display = get_display();
+	int event_base, error_base, major, minor;
+	if (!XTestQueryExtension(display, &event_base, &error_base, &major, &minor))
+		fatal("the X server does not support XTest\n");
+
+	long long begin = now_us();
+	for (size_t i = 0; i < numevents; i++) {
+		int detail;
+		const char *kind = input_kind(events[i].offset, &detail);
+		if (!strcmp(kind, "key"))
+			XTestFakeKeyEvent(display, (unsigned)detail, events[i].pressed, CurrentTime);
+		else if (!strcmp(kind, "button"))
+			XTestFakeButtonEvent(display, (unsigned)detail, events[i].pressed, CurrentTime);
+		if (p->rate) {
+			long long due = begin + (long long)(i + 1) * 1000000 / p->rate;
+			long long now = now_us();
+			XFlush(display);
+			if (due > now)
+				usleep((useconds_t)(due - now));
+		}
+	}
+	XSync(display, False);
+	printf("injected %zu events in %.3f s\n", numevents, (double)(now_us() - begin) / 1e6);
+	exit(0);
+}
+#endif
+
+/* The upper bound of the bucket holding the given fraction of the samples */
+static long long stats_percentile(const unsigned long *buckets, size_t num, double fraction)
+{
+	unsigned long total = 0, sum = 0;
+	for (size_t i = 0; i < num; i++)
+		total += buckets[i];
+	for (size_t i = 0; i < num; i++) {
+		sum += buckets[i];
+		if (sum && (double)sum >= fraction * (double)total)
+			return 1ll << i;
+	}
+	return 0;
+}
+
+/*
+ * Generate a pattern and print it as a trace, inject it through XTest, or run
+ * it through the hotkeys in this process (spawning their programs for real)
+ * and report what it cost.
+ */
+static void command_stress(const char *spec, uint64_t seed, bool trace, bool inject,
+			   struct hotkey_config *hotkeys, size_t numhotkeys)
+{
+	struct stress_params p;
+	parse_stress(spec, &p);
+	size_t numevents;
+	struct trace_event *events = stress_events(&p, seed, &numevents);
+
+	if (trace) {
+		for (size_t i = 0; i < numevents; i++) {
+			int detail;
+			const char *kind = input_kind(events[i].offset, &detail);
+			printf("%lld %s %s %d\n", p.rate ? (long long)i * 1000 / p.rate : 0,
+			       kind, events[i].pressed ? "press" : "release", detail);
+		}
+		exit(0);
+	}
+	if (inject) {
+#ifdef HAVE_XTEST
+		stress_inject(&p, events, numevents);
+#else
+		fatal("--inject is not available: thotkeys was built without XTest\n");
+#endif
+	}
+	if (!numhotkeys)
+		fatal("--stress needs --hotkey, --trace or --inject\n");
+
+	hotkeys_init(NULL, NULL, 0, hotkeys, numhotkeys);
+	struct rusage before, after;
+	getrusage(RUSAGE_SELF, &before);
+	long long begin = now_us();
+	last_event_mono = now_ms();
+	for (size_t i = 0; i < numevents; i++) {
+		struct input_change change = {
+			.offset = events[i].offset,
+			.pressed = events[i].pressed,
+		};
+		Time t = (Time)(p.rate ? (long long)i * 1000 / p.rate : 0);
+		last_event_time = t;
+		loop_woken = now_us();
+		hotkey_input(&change, t);
+		if (i % 64 == 63) {
+			run_timers();
+			loop_wait(0);
+		}
+	}
+	long long elapsed = now_us() - begin;
+	getrusage(RUSAGE_SELF, &after);
+
+	printf("pattern %s: %zu events in %.3f ms\n", spec, numevents, (double)elapsed / 1000);
+	printf("cpu: user %.3f ms, system %.3f ms\n",
+	       (double)((after.ru_utime.tv_sec - before.ru_utime.tv_sec) * 1000000 +
+			after.ru_utime.tv_usec - before.ru_utime.tv_usec) / 1000,
+	       (double)((after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1000000 +
+			after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1000);
+	printf("spawns: %lu, peak live children: %zu\n", child_spawns, peak_children);
+	printf("latency: p50 < %lld us, p99 < %lld us, max < %lld us\n",
+	       stats_percentile(input_latency, STATS_LATENCY_BUCKETS, 0.5),
+	       stats_percentile(input_latency, STATS_LATENCY_BUCKETS, 0.99),
+	       stats_percentile(input_latency, STATS_LATENCY_BUCKETS, 1.0));
+	exit(0);
+}
+
+/*
+ * Split a configuration file into arguments: words separated by white space,
+ * with '...' and "..." quoting and backslash escapes as in the shell, and
+ * comments from a '#' at the start of a word to the end of the line.
+ */
+static char **read_config(const char *path, int *argc)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		fatal("unable to open %s: %s\n", path, strerror(errno));
+
+	char **argv = xcalloc(2, sizeof(*argv));
+	int num = 1;
+	argv[0] = "thotkeys";
+	char *word = NULL;
+	size_t len = 0;
+	int quote = 0, ch;
+	bool in_word = false;
+	while ((ch = fgetc(fp)) != EOF) {
+		if (!quote && !in_word && ch == '#') {
+			while ((ch = fgetc(fp)) != EOF && ch != '\n')
+				;
+			continue;
+		}
+		if (!quote && (ch == ' ' || ch == '\t' || ch == '\n')) {
+			if (in_word) {
+				word = xrealloc(word, len + 1);
+				word[len] = '\0';
+				argv = xrealloc(argv, sizeof(*argv) * ((size_t)num + 2));
+				argv[num++] = word;
+				word = NULL;
+				len = 0;
+				in_word = false;
 			}
-			else if (c->activated && !matched) {
-				if (c->pid != -1) {
-					debug("sending SIGTERM to process %d\n", c->pid);
-					kill(c->pid, SIGTERM);
-				}
+			continue;
+		}
+		if (quote != '\'' && ch == '\\') {
+			ch = fgetc(fp);
+			if (ch == EOF)
+				break;
+			if (ch == '\n')
+				continue;
+			if (quote == '"' && !strchr("\"\\$`", ch)) {
+				word = xrealloc(word, len + 1);
+				word[len++] = '\\';
 			}
-			c->activated = matched;
 		}
+		else if (!quote && (ch == '\'' || ch == '"')) {
+			quote = ch;
+			in_word = true;
+			continue;
+		}
+		else if (quote == ch) {
+			quote = 0;
+			continue;
+		}
+		word = xrealloc(word, len + 1);
+		word[len++] = (char)ch;
+		in_word = true;
+	}
+	fclose(fp);
+	if (quote)
+		fatal("%s: unterminated %c quote\n", path, quote);
+	if (in_word) {
+		word = xrealloc(word, len + 1);
+		word[len] = '\0';
+		argv = xrealloc(argv, sizeof(*argv) * ((size_t)num + 2));
+		argv[num++] = word;
+	}
+	argv[num] = NULL;
+	*argc = num;
+	return argv;
+}
+
+static void print_c_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		unsigned char ch = (unsigned char)*str;
+		if (ch == '"' || ch == '\\')
+			printf("\\%c", ch);
+		else if (ch < 0x20 || ch >= 0x7f)
+			printf("\\%03o", ch);
+		else
+			putchar(ch);
+	}
+	putchar('"');
+}
+
+/*
+ * Print static-config.h for a build with --with-static-config: the arguments
+ * of the configuration, already split, and the keysyms of its --key options,
+ * already resolved. Keycodes depend on the server's keymap and are still
+ * looked up at startup.
+ */
+static void command_compile_config(const char *path, int argc, char **argv,
+				   const struct hotkey_config *hotkeys, size_t numhotkeys)
+{
+	KeySym *keysyms = NULL;
+	size_t numkeysyms = 0;
+	for (size_t i = 0; i < numhotkeys; i++) {
+		const struct hotkey_config *c = &hotkeys[i];
+		for (size_t j = 0; j < c->numkeystrs; j++) {
+			KeySym keysym = string_to_keysym(c->keystrs[j]);
+			if (keysym == NoSymbol)
+				keysym = XStringToKeysym(c->keystrs[j]);
+			if (keysym == NoSymbol)
+				fatal("--key %s could not be recognized\n", c->keystrs[j]);
+			keysyms = xrealloc(keysyms, sizeof(*keysyms) * (numkeysyms + 1));
+			keysyms[numkeysyms++] = keysym;
+		}
+		for (size_t j = 0; j < c->numpadstrs; j++)
+			if (pad_button_code(c->padstrs[j]) < 0)
+				fatal("--pad-button %s could not be recognized\n", c->padstrs[j]);
+	}
+
+	printf("/* Generated by thotkeys --compile-config from %s. Do not edit. */\n\n", path);
+	printf("#define STATIC_ARGC %d\n\n", argc);
+	printf("static const char *const static_argv[STATIC_ARGC + 1] = {\n");
+	for (int i = 0; i < argc; i++) {
+		printf("\t");
+		print_c_string(argv[i]);
+		printf(",\n");
+	}
+	printf("\tNULL\n};\n\n");
+
+	printf("static const KeySym static_keysyms[] = {");
+	for (size_t i = 0; i < numkeysyms; i++)
+		printf("%s0x%lx,", i % 8 ? " " : "\n\t", keysyms[i]);
+	printf("\n\tNoSymbol\n};\n");
+	exit(0);
+}
+
+static long parse_msec(const char *opt, const char *str)
+{
+	char *endp;
+	errno = 0;
+	long num = strtol(str, &endp, 10);
+	if (errno || endp == str || *endp || num < 1)
+		fatal("%s %s is not a valid duration in milliseconds\n", opt, str);
+	return num;
+}
+
+static void parse_rate(struct hotkey_config *c, const char *str)
+{
+	char *endp;
+	errno = 0;
+	long count = strtol(str, &endp, 10);
+	if (errno || endp == str || *endp != '/' || count < 1)
+		fatal("--rate-limit %s must be <count>/<ms>\n", str);
+	c->rate_count = count;
+	c->rate_window = parse_msec("--rate-limit", endp + 1);
+}
+
+/* --condition may come after the hotkeys that use it */
+static void resolve_conditions(struct hotkey_config *hotkeys, size_t numhotkeys)
+{
+	for (size_t i = 0; i < numhotkeys; i++) {
+		struct hotkey_config *c = &hotkeys[i];
+		for (size_t j = 0; j < c->numrequirestrs; j++) {
+			int n = find_condition(c->requirestrs[j]);
+			if (n < 0)
+				fatal("--require %s: no such --condition\n", c->requirestrs[j]);
+			c->require |= (uint64_t)1 << n;
+		}
+		for (size_t j = 0; j < c->numforbidstrs; j++) {
+			int n = find_condition(c->forbidstrs[j]);
+			if (n < 0)
+				fatal("--forbid %s: no such --condition\n", c->forbidstrs[j]);
+			c->forbid |= (uint64_t)1 << n;
+		}
+	}
+}
+
+static void add_hotkey(struct hotkey_config **hotkeys, size_t *numhotkeys,
+		       struct hotkey_config *current)
+{
+	if (current->wmstr) {
+		if (current->on_press)
+			fatal("--wm and --on-press cannot be used together\n");
+		if (current->accumulate)
+			fatal("--wm cannot be used with --accumulate\n");
+		if (current->latch)
+			fatal("--wm cannot be used with --latch or --on-unlatch\n");
+		current->on_press = current->wmstr;
+	}
+	if (current->accumulate) {
+		bool wheel = false;
+		for (size_t j = 0; j < current->numbuttonstrs; j++) {
+			long num = strtol(current->buttonstrs[j], NULL, 10);
+			wheel |= num >= 4 && num <= 7;
+		}
+		if (!wheel)
+			fatal("--accumulate requires a wheel button (4-7)\n");
 	}
+	if (current->latch) {
+		if (current->accumulate)
+			fatal("--latch cannot be used with --accumulate\n");
+		if (current->coalesce)
+			fatal("--latch cannot be used with --coalesce\n");
+	}
+	if ((!current->numkeystrs && !current->numbuttonstrs && !current->fingers &&
+	     !current->numpadstrs) ||
+	    !current->on_press)
+		fatal("--key and --on-press options are required\n");
+	*hotkeys = xrealloc(*hotkeys, sizeof(**hotkeys) * (*numhotkeys + 1));
+	(*hotkeys)[(*numhotkeys)++] = *current;
+	*current = (struct hotkey_config) { 0 };
 }
 
+enum {
+	OPT_VERIFY = 256,
+	OPT_TRACE,
+	OPT_REPLAY,
+	OPT_SEED,
+	OPT_ROUNDS,
+	OPT_STARTUP_REPORT,
+	OPT_FINGERS,
+	OPT_PAD_BUTTON,
+	OPT_PAD_DEVICE,
+	OPT_CONDITION,
+	OPT_REQUIRE,
+	OPT_FORBID,
+	OPT_LATCH,
+	OPT_ON_UNLATCH,
+	OPT_STATS_FILE,
+	OPT_STATE_FILE,
+	OPT_STRESS,
+	OPT_INJECT,
+	OPT_WM,
+	OPT_LED,
+	OPT_BELL,
+	OPT_SHADOW,
+	OPT_WHEN,
+	OPT_DEFER,
+	OPT_TOUCH,
+};
+
 int main(int argc, char **argv)
 {
-	const char *device_name = NULL;
-	bool do_help = false, do_monitor = false, do_hotkeys = false;
-	size_t numhotkeys = 0, numkeys = 0, numbuttons = 0;
-	struct hotkey_config *hotkeys = NULL;
-	const char **keys = NULL, **buttons = NULL, *on_press = NULL;
+	startup_begin = startup_last = now_us();
+
+	const char *device_name = NULL, *replay = NULL, *stress = NULL;
+	bool do_help = false, do_monitor = false, do_hotkeys = false, do_verify = false;
+	bool trace = false, inject = false, touch = false;
+	unsigned long long seed = 1;
+	long rounds = 1000;
+	size_t numhotkeys = 0, numpad_paths = 0;
+	const char **pad_paths = NULL;
+	struct hotkey_config *hotkeys = NULL, current = { 0 };
+
+	const char *compile_path = NULL;
+	if (argc == 3 && !strcmp(argv[1], "--compile-config")) {
+		compile_path = argv[2];
+		argv = read_config(compile_path, &argc);
+	}
+#ifdef STATIC_CONFIG
+	else if (argc == 1) {
+		/* getopt_long() may permute argv, so only the pointers are copied */
+		argc = STATIC_ARGC;
+		argv = xcalloc(STATIC_ARGC + 1, sizeof(*argv));
+		for (int i = 0; i < STATIC_ARGC; i++)
+			argv[i] = (char *)static_argv[i];
+		preresolved_keysyms = static_keysyms;
+	}
+#endif
 
 	while (1) {
 		static struct option long_options[] = {
-			{ "verbose",  no_argument,       0, 'V' },
-			{ "version",  no_argument,       0, 'H' },
-			{ "help",     no_argument,       0, 'H' },
-			{ "monitor",  no_argument,       0, 'M' },
-			{ "hotkey",   no_argument,       0, 'K' },
-
-			{ "device",   required_argument, 0, 'd' },
-			{ "key",      required_argument, 0, 'k' },
-			{ "button",   required_argument, 0, 'b' },
-			{ "on-press", required_argument, 0, 'p' },
+			{ "verbose",    no_argument,       0, 'V' },
+			{ "version",    no_argument,       0, 'H' },
+			{ "help",       no_argument,       0, 'H' },
+			{ "monitor",    no_argument,       0, 'M' },
+			{ "touch",      no_argument,       0, OPT_TOUCH },
+			{ "hotkey",     no_argument,       0, 'K' },
+
+			{ "device",     required_argument, 0, 'd' },
+			{ "key",        required_argument, 0, 'k' },
+			{ "button",     required_argument, 0, 'b' },
+			{ "fingers",    required_argument, 0, OPT_FINGERS },
+			{ "pad-button", required_argument, 0, OPT_PAD_BUTTON },
+			{ "pad-device", required_argument, 0, OPT_PAD_DEVICE },
+			{ "on-press",   required_argument, 0, 'p' },
+			{ "wm",         required_argument, 0, OPT_WM },
+			{ "led",        required_argument, 0, OPT_LED },
+			{ "bell",       required_argument, 0, OPT_BELL },
+			{ "accumulate", required_argument, 0, 'a' },
+			{ "cooldown",   required_argument, 0, 'c' },
+			{ "rate-limit", required_argument, 0, 'r' },
+			{ "coalesce",   no_argument,       0, 'C' },
+			{ "latch",      no_argument,       0, OPT_LATCH },
+			{ "on-unlatch", required_argument, 0, OPT_ON_UNLATCH },
+			{ "stats-file", required_argument, 0, OPT_STATS_FILE },
+			{ "shadow",     no_argument,       0, OPT_SHADOW },
+			{ "defer",      required_argument, 0, OPT_DEFER },
+			{ "state-file", required_argument, 0, OPT_STATE_FILE },
+			{ "condition",  required_argument, 0, OPT_CONDITION },
+			{ "require",    required_argument, 0, OPT_REQUIRE },
+			{ "forbid",     required_argument, 0, OPT_FORBID },
+			{ "when",       required_argument, 0, OPT_WHEN },
+
+			{ "verify-matcher", no_argument,   0, OPT_VERIFY },
+			{ "trace",      no_argument,       0, OPT_TRACE },
+			{ "replay",     required_argument, 0, OPT_REPLAY },
+			{ "seed",       required_argument, 0, OPT_SEED },
+			{ "rounds",     required_argument, 0, OPT_ROUNDS },
+			{ "stress",     required_argument, 0, OPT_STRESS },
+			{ "inject",     no_argument,       0, OPT_INJECT },
+			{ "startup-report", no_argument,   0, OPT_STARTUP_REPORT },
 			{ 0 }
 		};
 
@@ -377,62 +4282,159 @@ int main(int argc, char **argv)
 		case 'M':
 			do_monitor = true;
 			break;
+		case OPT_TOUCH:
+			touch = true; break;
 		case 'K':
-			if (do_hotkeys) {
-				if ((!keys && !buttons) || !on_press)
-					fatal("--key and --on-press options are required\n");
-				hotkeys = xrealloc(hotkeys, sizeof(*hotkeys) * (numhotkeys + 1));
-				hotkeys[numhotkeys++] = (struct hotkey_config) {
-					.keystrs = keys,
-					.numkeystrs = numkeys,
-					.buttonstrs = buttons,
-					.numbuttonstrs = numbuttons,
-					.on_press = on_press,
-				};
-				keys = NULL;
-				numkeys = 0;
-				numbuttons = 0;
-				on_press = NULL;
-			}
+			if (do_hotkeys)
+				add_hotkey(&hotkeys, &numhotkeys, &current);
 			do_hotkeys = true;
 			break;
 		case 'd':
 			device_name = optarg; break;
 		case 'k':
-			keys = xrealloc(keys, sizeof(*keys) * (numkeys + 1));
-			keys[numkeys++] = optarg;
+			current.keystrs = xrealloc(current.keystrs,
+				sizeof(*current.keystrs) * (current.numkeystrs + 1));
+			current.keystrs[current.numkeystrs++] = optarg;
 			break;
 		case 'b':
-			buttons = xrealloc(buttons, sizeof(*buttons) * (numbuttons + 1));
-			buttons[numbuttons++] = optarg;
+		{
+			long num = strtol(optarg, NULL, 10);
+			if (num < 1 || num > 255)
+				fatal("--button %s could not be recognized\n", optarg);
+			current.buttonstrs = xrealloc(current.buttonstrs,
+				sizeof(*current.buttonstrs) * (current.numbuttonstrs + 1));
+			current.buttonstrs[current.numbuttonstrs++] = optarg;
 			break;
+		}
 		case 'p':
-			on_press = optarg; break;
+			current.on_press = optarg; break;
+		case OPT_FINGERS:
+			current.fingers = strtol(optarg, NULL, 10);
+			if (current.fingers < 1 || current.fingers > MAX_FINGERS)
+				fatal("--fingers %s must be between 1 and %d\n", optarg, MAX_FINGERS);
+			break;
+		case OPT_PAD_BUTTON:
+			if (pad_button_code(optarg) < 0)
+				fatal("--pad-button %s could not be recognized\n", optarg);
+			current.padstrs = xrealloc(current.padstrs,
+				sizeof(*current.padstrs) * (current.numpadstrs + 1));
+			current.padstrs[current.numpadstrs++] = optarg;
+			break;
+		case OPT_PAD_DEVICE:
+			pad_paths = xrealloc(pad_paths, sizeof(*pad_paths) * (numpad_paths + 1));
+			pad_paths[numpad_paths++] = optarg;
+			break;
+		case 'a':
+			current.accumulate = parse_msec("--accumulate", optarg); break;
+		case 'c':
+			current.cooldown = parse_msec("--cooldown", optarg); break;
+		case 'r':
+			parse_rate(&current, optarg); break;
+		case 'C':
+			current.coalesce = true; break;
+		case OPT_WM:
+			current.wmstr = optarg;
+			parse_wm_action(optarg, &current.wm);
+			break;
+		case OPT_LED:
+			current.led = optarg; break;
+		case OPT_BELL:
+		{
+			char *endp;
+			long percent = strtol(optarg, &endp, 10);
+			if (endp == optarg || *endp || percent < -100 || percent > 100 || !percent)
+				fatal("--bell %s must be a volume from -100 to 100, not 0\n", optarg);
+			current.bell = (int)percent;
+			break;
+		}
+		case OPT_LATCH:
+			current.latch = true; break;
+		case OPT_ON_UNLATCH:
+			current.latch = true;
+			current.on_unlatch = optarg;
+			break;
+		case OPT_STATS_FILE:
+			stats_path = optarg; break;
+		case OPT_SHADOW:
+			shadow = true; break;
+		case OPT_DEFER:
+			defer_window = parse_msec("--defer", optarg); break;
+		case OPT_STATE_FILE:
+			state_path = optarg; break;
+		case OPT_STRESS:
+			stress = optarg; break;
+		case OPT_INJECT:
+			inject = true; break;
+		case OPT_CONDITION:
+			add_condition(optarg); break;
+		case OPT_REQUIRE:
+			current.requirestrs = xrealloc(current.requirestrs,
+				sizeof(*current.requirestrs) * (current.numrequirestrs + 1));
+			current.requirestrs[current.numrequirestrs++] = optarg;
+			break;
+		case OPT_FORBID:
+			current.forbidstrs = xrealloc(current.forbidstrs,
+				sizeof(*current.forbidstrs) * (current.numforbidstrs + 1));
+			current.forbidstrs[current.numforbidstrs++] = optarg;
+			break;
+		case OPT_WHEN:
+			current.whenstrs = xrealloc(current.whenstrs,
+				sizeof(*current.whenstrs) * (current.numwhenstrs + 1));
+			current.whenstrs[current.numwhenstrs++] = optarg;
+			break;
+		case OPT_VERIFY:
+			do_verify = true; break;
+		case OPT_TRACE:
+			trace = true; break;
+		case OPT_REPLAY:
+			replay = optarg; break;
+		case OPT_STARTUP_REPORT:
+			startup_report = true; break;
+		case OPT_SEED:
+		{
+			char *endp;
+			errno = 0;
+			seed = strtoull(optarg, &endp, 0);
+			if (errno || endp == optarg || *endp || *optarg == '-')
+				fatal("--seed %s must be a non-negative number\n", optarg);
+			break;
+		}
+		case OPT_ROUNDS:
+		{
+			char *endp;
+			errno = 0;
+			rounds = strtol(optarg, &endp, 10);
+			if (errno || endp == optarg || *endp || rounds < 1)
+				fatal("--rounds %s must be a positive number\n", optarg);
+			break;
+		}
 		case '?':
 			exit(1);
 		default:
 			fatal("[BUG] unknown option '%c'\n", c);
 		}
 	}
-	if (do_hotkeys) {
-		if ((!keys && !buttons) || !on_press)
-			fatal("--key and --on-press options are required\n");
-		hotkeys = xrealloc(hotkeys, sizeof(*hotkeys) * (numhotkeys + 1));
-		hotkeys[numhotkeys++] = (struct hotkey_config) {
-			.keystrs = keys,
-			.numkeystrs = numkeys,
-			.buttonstrs = buttons,
-			.numbuttonstrs = numbuttons,
-			.on_press = on_press,
-		};
-	}
+	if (do_hotkeys)
+		add_hotkey(&hotkeys, &numhotkeys, &current);
+	resolve_conditions(hotkeys, numhotkeys);
 	if (optind != argc)
 		fatal("unknown argument %s\n", argv[optind]);
 
+	if (shadow && state_path) {
+		warn("--state-file is ignored with --shadow\n");
+		state_path = NULL;
+	}
+	if (compile_path)
+		command_compile_config(compile_path, argc, argv, hotkeys, numhotkeys);
 	if (do_help)
 		command_help();
+	if (do_verify)
+		command_verify(replay, seed, rounds, hotkeys, numhotkeys);
+	if (stress)
+		command_stress(stress, seed, trace, inject, hotkeys, numhotkeys);
 	if (do_monitor)
-		command_monitor(device_name);
+		command_monitor(device_name, pad_paths, numpad_paths, trace, touch);
 	if (do_hotkeys)
-		command_hotkeys(device_name, hotkeys, numhotkeys);
+		command_hotkeys(device_name, pad_paths, numpad_paths, hotkeys, numhotkeys);
+	return 0;
 }